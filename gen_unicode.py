@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+# Generates unicode.h, the codepoint property tables used by main.c, from
+# the Unicode database that ships with Python:
+#
+#     python3 gen_unicode.py > unicode.h
+#
+# Each table is two-level: a stage 1 array indexed by codepoint >> 8 picks
+# one of the distinct 256 codepoint blocks in stage 2, where each entry
+# takes BITS bits. Most of the codespace shares a handful of blocks.
+
+import sys
+import unicodedata
+
+CODEPOINTS = 0x110000
+BLOCK = 256
+
+
+def width(cp):
+    """0 for marks and other zero width codepoints, 2 for East Asian wide
+    and fullwidth ones, 1 otherwise."""
+    c = chr(cp)
+    category = unicodedata.category(c)
+    if cp == 0x00ad:
+        return 1
+    if category in ('Mn', 'Me', 'Cf', 'Cc'):
+        return 0
+    # Hangul medial vowels and final consonants join the preceding jamo.
+    if 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff:
+        return 0
+    if cp == 0x200b:
+        return 0
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    return 1
+
+
+# Grapheme_Cluster_Break values, in table order. Extended_Pictographic
+# codepoints all have the break property Other, so they get a value of
+# their own instead of a second table.
+GRAPHEME = ['OTHER', 'CR', 'LF', 'CONTROL', 'EXTEND', 'ZWJ',
+            'REGIONAL_INDICATOR', 'PREPEND', 'SPACING_MARK',
+            'L', 'V', 'T', 'LV', 'LVT', 'PICTOGRAPHIC']
+
+# Python's database has no break or emoji properties, so the lists that
+# are not derivable from the general category are copied from
+# GraphemeBreakProperty.txt, PropList.txt and emoji-data.txt.
+PREPEND = [(0x0600, 0x0605), (0x06dd, 0x06dd), (0x070f, 0x070f),
+           (0x0890, 0x0891), (0x08e2, 0x08e2), (0x0d4e, 0x0d4e),
+           (0x110bd, 0x110bd), (0x110cd, 0x110cd), (0x111c2, 0x111c3),
+           (0x1193f, 0x1193f), (0x11941, 0x11941), (0x11a3a, 0x11a3a),
+           (0x11a84, 0x11a89), (0x11d46, 0x11d46)]
+
+OTHER_GRAPHEME_EXTEND = [
+    (0x09be, 0x09be), (0x09d7, 0x09d7), (0x0b3e, 0x0b3e), (0x0b57, 0x0b57),
+    (0x0bbe, 0x0bbe), (0x0bd7, 0x0bd7), (0x0cc2, 0x0cc2), (0x0cd5, 0x0cd6),
+    (0x0d3e, 0x0d3e), (0x0d57, 0x0d57), (0x0dcf, 0x0dcf), (0x0ddf, 0x0ddf),
+    (0x1b35, 0x1b35), (0x200c, 0x200c), (0x302e, 0x302f), (0xff9e, 0xff9f),
+    (0x1133e, 0x1133e), (0x11357, 0x11357), (0x114b0, 0x114b0),
+    (0x114bd, 0x114bd), (0x115af, 0x115af), (0x11930, 0x11930),
+    (0x1d165, 0x1d165), (0x1d16e, 0x1d172), (0xe0020, 0xe007f),
+    # Emoji_Modifier
+    (0x1f3fb, 0x1f3ff)]
+
+SPACING_MARK_EXTRA = [(0x0e33, 0x0e33), (0x0eb3, 0x0eb3)]
+
+SPACING_MARK_EXCEPT = [
+    (0x102b, 0x102c), (0x1038, 0x1038), (0x1062, 0x1064), (0x1067, 0x106d),
+    (0x1083, 0x1083), (0x1087, 0x108c), (0x108f, 0x108f), (0x109a, 0x109c),
+    (0x1a61, 0x1a61), (0x1a63, 0x1a64), (0xaa7b, 0xaa7b), (0xaa7d, 0xaa7d),
+    (0x11720, 0x11721)]
+
+# Unassigned default ignorables, which break like controls.
+IGNORABLE_CONTROL = [(0xfff0, 0xfff8), (0xe0000, 0xe001f),
+                     (0xe0080, 0xe0fff)]
+
+EXTENDED_PICTOGRAPHIC = [
+    (0x00a9, 0x00a9), (0x00ae, 0x00ae), (0x203c, 0x203c), (0x2049, 0x2049),
+    (0x2122, 0x2122), (0x2139, 0x2139), (0x2194, 0x2199), (0x21a9, 0x21aa),
+    (0x231a, 0x231b), (0x2328, 0x2328), (0x2388, 0x2388), (0x23cf, 0x23cf),
+    (0x23e9, 0x23f3), (0x23f8, 0x23fa), (0x24c2, 0x24c2), (0x25aa, 0x25ab),
+    (0x25b6, 0x25b6), (0x25c0, 0x25c0), (0x25fb, 0x25fe), (0x2600, 0x2605),
+    (0x2607, 0x2612), (0x2614, 0x2685), (0x2690, 0x2705), (0x2708, 0x2712),
+    (0x2714, 0x2714), (0x2716, 0x2716), (0x271d, 0x271d), (0x2721, 0x2721),
+    (0x2728, 0x2728), (0x2733, 0x2734), (0x2744, 0x2744), (0x2747, 0x2747),
+    (0x274c, 0x274c), (0x274e, 0x274e), (0x2753, 0x2755), (0x2757, 0x2757),
+    (0x2763, 0x2767), (0x2795, 0x2797), (0x27a1, 0x27a1), (0x27b0, 0x27b0),
+    (0x27bf, 0x27bf), (0x2934, 0x2935), (0x2b05, 0x2b07), (0x2b1b, 0x2b1c),
+    (0x2b50, 0x2b50), (0x2b55, 0x2b55), (0x3030, 0x3030), (0x303d, 0x303d),
+    (0x3297, 0x3297), (0x3299, 0x3299), (0x1f000, 0x1f0ff),
+    (0x1f10d, 0x1f10f), (0x1f12f, 0x1f12f), (0x1f16c, 0x1f171),
+    (0x1f17e, 0x1f17f), (0x1f18e, 0x1f18e), (0x1f191, 0x1f19a),
+    (0x1f1ad, 0x1f1e5), (0x1f201, 0x1f20f), (0x1f21a, 0x1f21a),
+    (0x1f22f, 0x1f22f), (0x1f232, 0x1f23a), (0x1f23c, 0x1f23f),
+    (0x1f249, 0x1f3fa), (0x1f400, 0x1f53d), (0x1f546, 0x1f64f),
+    (0x1f680, 0x1f6ff), (0x1f774, 0x1f77f), (0x1f7d5, 0x1f7ff),
+    (0x1f80c, 0x1f80f), (0x1f848, 0x1f84f), (0x1f85a, 0x1f85f),
+    (0x1f888, 0x1f88f), (0x1f8ae, 0x1f8ff), (0x1f90c, 0x1f93a),
+    (0x1f93c, 0x1f945), (0x1f947, 0x1faff), (0x1fc00, 0x1fffd)]
+
+
+def in_ranges(cp, ranges):
+    return any(first <= cp <= last for first, last in ranges)
+
+
+def grapheme(cp):
+    """Grapheme_Cluster_Break as defined by UAX #29, with
+    Extended_Pictographic folded in."""
+    c = chr(cp)
+    category = unicodedata.category(c)
+    if cp == 0x0d:
+        return 'CR'
+    if cp == 0x0a:
+        return 'LF'
+    if cp == 0x200d:
+        return 'ZWJ'
+    if in_ranges(cp, PREPEND):
+        return 'PREPEND'
+    if category in ('Mn', 'Me') or in_ranges(cp, OTHER_GRAPHEME_EXTEND):
+        return 'EXTEND'
+    if category in ('Zl', 'Zp', 'Cc', 'Cs', 'Cf') or in_ranges(cp, IGNORABLE_CONTROL):
+        return 'CONTROL'
+    if 0x1f1e6 <= cp <= 0x1f1ff:
+        return 'REGIONAL_INDICATOR'
+    if ((category == 'Mc' or in_ranges(cp, SPACING_MARK_EXTRA))
+            and not in_ranges(cp, SPACING_MARK_EXCEPT)):
+        return 'SPACING_MARK'
+    if 0x1100 <= cp <= 0x115f or 0xa960 <= cp <= 0xa97c:
+        return 'L'
+    if 0x1160 <= cp <= 0x11a7 or 0xd7b0 <= cp <= 0xd7c6:
+        return 'V'
+    if 0x11a8 <= cp <= 0x11ff or 0xd7cb <= cp <= 0xd7fb:
+        return 'T'
+    if 0xac00 <= cp <= 0xd7a3:
+        return 'LV' if (cp - 0xac00) % 28 == 0 else 'LVT'
+    if in_ranges(cp, EXTENDED_PICTOGRAPHIC):
+        return 'PICTOGRAPHIC'
+    return 'OTHER'
+
+
+def emit_table(out, name, values, bits):
+    per_byte = 8 // bits
+    blocks = {}
+    stage1 = []
+    stage2 = []
+    for base in range(0, CODEPOINTS, BLOCK):
+        block = tuple(values[base:base + BLOCK])
+        if block not in blocks:
+            blocks[block] = len(blocks)
+            packed = []
+            for i in range(0, BLOCK, per_byte):
+                byte = 0
+                for j in range(per_byte):
+                    byte |= block[i + j] << (j * bits)
+                packed.append(byte)
+            stage2.append(packed)
+        stage1.append(blocks[block])
+    assert len(blocks) <= 256
+    size = BLOCK // per_byte
+    out.write('static const uint8_t %s_stage1[%d] = {\n' % (name, len(stage1)))
+    for i in range(0, len(stage1), 16):
+        out.write('    %s,\n' % ', '.join('%d' % v for v in stage1[i:i + 16]))
+    out.write('};\n\n')
+    out.write('static const uint8_t %s_stage2[%d][%d] = {\n' % (name, len(stage2), size))
+    for packed in stage2:
+        out.write('    {\n')
+        for i in range(0, size, 16):
+            out.write('        %s,\n' % ', '.join('0x%02x' % v for v in packed[i:i + 16]))
+        out.write('    },\n')
+    out.write('};\n')
+
+
+def main():
+    out = sys.stdout
+    out.write('/* Generated by gen_unicode.py from Unicode %s. Do not edit. */\n\n'
+              % unicodedata.unidata_version)
+    out.write('#define UNICODE_BLOCK_SHIFT 8\n')
+    out.write('#define UNICODE_BLOCK_MASK 0xff\n\n')
+    out.write('/* Column widths, 2 bits per codepoint. */\n')
+    emit_table(out, 'width', [width(cp) for cp in range(CODEPOINTS)], 2)
+    out.write('\n/* Grapheme cluster break properties, 4 bits per codepoint. */\n')
+    out.write('enum {\n')
+    for name in GRAPHEME:
+        out.write('    GRAPHEME_%s,\n' % name)
+    out.write('};\n\n')
+    index = {name: i for i, name in enumerate(GRAPHEME)}
+    emit_table(out, 'grapheme', [index[grapheme(cp)] for cp in range(CODEPOINTS)], 4)
+
+
+if __name__ == '__main__':
+    main()
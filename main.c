@@ -11,100 +11,840 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <regex.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SYNTHESIS_H
+#include <fontconfig/fontconfig.h>
+
+#ifdef GLTTY_HARFBUZZ
+#include <hb.h>
+#include <hb-ft.h>
+#endif
+
+#include "unicode.h"
 
 #define ASCII_BEGIN 0x20
 #define ASCII_END 0x7e
-#define ASCII_COUNT ASCII_END - ASCII_BEGIN + 1
+#define ASCII_COUNT (ASCII_END - ASCII_BEGIN + 1)
 
+/* Initial grid size; the grid follows the window from then on. */
 #define TTY_COLUMNS 80
 #define TTY_ROWS 24
-#define TTY_COUNT (TTY_ROWS * TTY_ROWS)
 
-typedef struct {
-    int width;
-    int height;
-    void *data;
-} Bitmap;
+#define SCROLLBACK_BLOCK_SIZE (64 * 1024)
+#define SCROLLBACK_BLOOM_BITS 65536
+#define SEARCH_QUERY_MAX 256
+#define TTY_READS_PER_FRAME 64
+#define CSI_PARAMS_MAX 32
 
+/* A face of the fallback chain, opened on first use. `failed` faces could
+ * not be opened or scaled and are skipped. */
 typedef struct {
-    int x;
-    int y;
-} Bearing;
+    FT_Face face;
+    bool failed;
+} FontFace;
 
+/* Style variants of the font, also the layers of the glyph atlas. */
+enum {
+    FONT_REGULAR = 0,
+    FONT_BOLD = 1 << 0,
+    FONT_ITALIC = 1 << 1,
+    FONT_VARIANTS = 4,
+};
+
+/* `fallbacks` is the fontconfig match list for one variant, best first,
+ * trimmed to the fonts that add coverage; faces[i] is its i-th font. */
 typedef struct {
-    char c;
-    Bearing bearing;
-    Bitmap bitmap;
-    int width;
-    int height;
-    float u1, u2, v1, v2;
-} Character;
+    FcFontSet *fallbacks;
+    FontFace *faces;
+} FontChain;
 
+/* `pattern` is the configured name as parsed, before defaults are filled
+ * in, so that variants can ask for another weight and slant. Chains other
+ * than the regular one are matched on first use of their variant. The
+ * regular chain's first face sets the cell size. */
 typedef struct {
-    Character chars[ASCII_COUNT];
+    FT_Library library;
+    FcPattern *pattern;
+    FontChain chains[FONT_VARIANTS];
+    int size;
     int char_width;
     int char_height;
-    int atlas_width;
-    int atlas_height;
+    int descent;
 } Font;
 
+/* Glyph ids past ASCII, resolved on first sight of a codepoint: `bmp` is
+ * direct mapped, the rest of the codespace goes into an open addressed
+ * hash of `capacity` slots keyed by codepoint. 0 is not resolved yet. */
+#define GLYPH_BMP 0x10000
 typedef struct {
-    GLuint program;
-    GLuint texture;
-    GLuint vao;
-    GLuint vbo;
-    float projection[16];
-    float *vertices;
-    size_t vertices_size;
-} RenderContext;
+    uint32_t *bmp;
+    uint32_t *keys;
+    uint32_t *values;
+    size_t capacity;
+    size_t count;
+} GlyphCache;
 
+/* Glyph ids 1 to ASCII_COUNT are printable ASCII and GLYPH_EMPTY a glyph
+ * with no coverage. Every id has a slot per font variant, filled on first
+ * use of the variant; the variant comes from the cell's style. The top bits
+ * of a drawn glyph are a signed column offset: the cell draws the part of
+ * the glyph that many columns right of its origin, the second cell of a
+ * wide glyph its right half and the cells of a shaped ligature theirs. */
+#define GLYPH_EMPTY (ASCII_COUNT + 1)
+#define GLYPH_FLOATS (8 * FONT_VARIANTS)
+#define GLYPH_COLUMN_SHIFT 28
+#define GLYPH_COLUMN(offset) ((uint32_t) (offset) << GLYPH_COLUMN_SHIFT)
+#define GLYPH_RIGHT_HALF GLYPH_COLUMN(1)
+#define GLYPH_ATLAS_SIZE 1024
+
+/* `style` is a style id, with INSTANCE_HIGHLIGHT set for search matches.
+ * `glyph` 0 draws no glyph, only the cell background and decorations. */
 typedef struct {
-    char c;
-    int x;
-    int y;
-} Cell;
+    uint16_t column;
+    uint16_t row;
+    uint32_t glyph;
+    uint32_t style;
+} Instance;
 
+#define INSTANCE_HIGHLIGHT 0x10000u
+#define INSTANCE_REGIONS 3
+
+/* The layout glMultiDrawArraysIndirect() reads, one per row slot. */
 typedef struct {
-    Cell *cells;
+    GLuint count;
+    GLuint instance_count;
+    GLuint first;
+    GLuint base_instance;
+} DrawCommand;
+#define INSTANCE_BANDS_MAX 64
+/* Below this many cells instances are built on the rendering thread. */
+#define INSTANCE_PARALLEL_MIN 16384
+
+/* RENDER_INSTANCED draws every non-empty cell each frame, RENDER_GRID
+ * shades a GPU resident copy of the grid and RENDER_RETAINED redraws only
+ * damaged cells into a persistent framebuffer. */
+typedef enum {
+    RENDER_INSTANCED,
+    RENDER_GRID,
+    RENDER_RETAINED,
+} RenderMode;
+
+/* A cell packs a 21-bit codepoint, a 16-bit style id and 27 flag bits into
+ * one word, so rows are plain uint64_t arrays and clears are word fills. */
+typedef uint64_t Cell;
+
+#define CELL_CODEPOINT_MASK 0x1fffffu
+#define CELL_STYLE_SHIFT 21
+#define CELL_FLAGS_SHIFT 37
+#define CELL_BLANK ((Cell) ' ')
+
+/* A wide character takes a CELL_WIDE cell and a CELL_SPACER cell after it,
+ * which holds no codepoint. A spacer with no wide cell before it pads the
+ * end of a row where a wide character did not fit. A cell holds the first
+ * codepoint of a grapheme cluster; the flag bits from CELL_CLUSTER_SHIFT
+ * up are the id of the rest of it in the terminal's ClusterTable, 0 if the
+ * cluster is that one codepoint. */
+enum {
+    CELL_WIDE = 1 << 0,
+    CELL_SPACER = 1 << 1,
+};
+#define CELL_CLUSTER_SHIFT 2
+
+#define REPLACEMENT_CHARACTER 0xfffd
+/* Codepoints kept after the first of a cluster; further ones are dropped.
+ * Enough for the longest emoji ZWJ sequences with skin tones. */
+#define CLUSTER_MAX 15
+#define CLUSTER_TABLE_MAX 65536
+/* UTF-8 bytes a cell can turn into: its whole cluster. */
+#define CELL_UTF8_MAX (4 * (1 + CLUSTER_MAX))
+
+#define COLOR_DEFAULT 0u
+#define COLOR_PALETTE 0x01000000u
+#define COLOR_RGB 0x02000000u
+#define COLOR_TYPE(c) ((c) & 0xff000000u)
+
+enum {
+    ATTR_BOLD = 1 << 0,
+    ATTR_DIM = 1 << 1,
+    ATTR_ITALIC = 1 << 2,
+    ATTR_UNDERLINE = 1 << 3,
+    ATTR_INVERSE = 1 << 4,
+    ATTR_STRIKETHROUGH = 1 << 5,
+};
+
+/* Colors are COLOR_DEFAULT, COLOR_PALETTE | index or COLOR_RGB | 0xrrggbb.
+ * The struct has no padding so styles can be hashed and compared bytewise. */
+typedef struct {
+    uint32_t fg;
+    uint32_t bg;
+    uint32_t underline;
+    uint32_t attrs;
+} Style;
+
+#define STYLE_DEFAULT 0
+#define STYLE_MAX 65536
+
+/* Interned, deduplicated styles. Id 0 is the default style. Unused ids are
+ * reclaimed by a mark and sweep over the grid whenever the table fills up. */
+typedef struct {
+    Style *styles;
+    uint32_t *slots;
+    uint16_t *free_ids;
+    uint8_t *marks;
+    size_t capacity;
+    size_t count;
+    size_t free_count;
+    unsigned version;
+} StyleTable;
+
+/* The codepoints of a cluster after the first, zero padded so they are
+ * hashed and compared bytewise. */
+typedef struct {
+    uint32_t codepoints[CLUSTER_MAX];
+} Cluster;
+
+/* Interned grapheme clusters, the side table cells refer to. Id 0 is no
+ * further codepoints. Like styles, unused ids are reclaimed by a mark and sweep
+ * over the grid when the table fills up. */
+typedef struct {
+    Cluster *entries;
+    uint32_t *slots;
+    uint32_t *free_ids;
+    uint8_t *live;
     size_t capacity;
     size_t count;
+    size_t free_count;
+} ClusterTable;
+
+/* Columns [begin, end) of a row written since the last frame. A clean row
+ * has begin >= end. */
+typedef struct {
+    uint16_t begin;
+    uint16_t end;
+} Damage;
+
+/* The screen is a ring of rows: logical row y lives in physical row
+ * (top + y) % rows, so scrolling advances `top` and clears one row.
+ * `wrapped`, `damage` and `stamps` are indexed by physical row. Storage
+ * grows geometrically on resize and is never shrunk, so dragging a window
+ * edge reallocates only a handful of times.
+ *
+ * Clearing the screen only bumps `generation` and sets `damage_all`: a row
+ * whose stamp is older holds nothing but `blank` and is unwrapped, and is
+ * filled in when it is next accessed through cells_row(). */
+typedef struct {
+    Cell *cells;
+    bool *wrapped;
+    Damage *damage;
+    uint32_t *stamps;
+    uint32_t generation;
+    bool damage_all;
+    Cell blank;
+    size_t count;
+    size_t capacity;
+    int row_capacity;
+    int columns;
+    int rows;
+    int top;
 } Cells;
 
+typedef enum {
+    STATE_GROUND,
+    STATE_ESCAPE,
+    STATE_ESCAPE_HASH,
+    STATE_CSI,
+    STATE_OSC,
+} ParserState;
+
+/* Cursor state kept by DECSC and DECSET 1049. The pen is kept rather than
+ * its style id, which the style table may reclaim in the meantime. */
+typedef struct {
+    size_t cursor_x;
+    size_t cursor_y;
+    bool reflow_wrap;
+    Style pen;
+} SavedCursor;
+
+/* Grapheme cluster segmentation state at the end of the last cluster
+ * written: the break property of its last codepoint, whether it is a
+ * pictograph followed by extenders and at most one ZWJ, and whether it
+ * ends in an odd number of regional indicators. Setting `last` to
+ * GRAPHEME_CONTROL alone breaks before whatever comes next. */
+typedef struct {
+    uint8_t last;
+    bool pictographic;
+    bool regional_odd;
+} Segmenter;
+
+/* `inactive` is the screen not being written: the alternate screen,
+ * allocated on first use, or the primary screen while the alternate one
+ * is shown. Switching swaps it with the caller's screen pointer. */
 typedef struct {
     size_t cursor;
     size_t cursor_x;
     size_t cursor_y;
+    /* Set when a reflow to a wider screen took the cursor out of a pending
+     * wrap, so narrowing again puts it back. Cleared by any output. */
+    bool reflow_wrap;
     int columns;
     int rows;
+    StyleTable styles;
+    ClusterTable clusters;
+    Style pen;
+    uint16_t style;
+    bool reverse;
+    /* The UTF-8 sequence being decoded: its bits so far, the continuation
+     * bytes still expected and its length. */
+    uint32_t utf8_codepoint;
+    int utf8_remaining;
+    int utf8_length;
+    Segmenter segmenter;
+    Cells *inactive;
+    bool alternate;
+    SavedCursor saved;
+    ParserState state;
+    int params[CSI_PARAMS_MAX];
+    bool subparams[CSI_PARAMS_MAX];
+    int param_count;
+    char private_marker;
 } Terminal;
 
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*TaskFunc)(void *arg, size_t task, int worker);
+
+typedef struct Batch {
+    TaskFunc func;
+    void *arg;
+    size_t count;
+    size_t next;
+    size_t finished;
+    struct Batch *queue_next;
+} Batch;
+
+typedef struct {
+    ThreadPool *pool;
+    pthread_t thread;
+    int index;
+} Worker;
+
+/* Worker indices passed to tasks are 0..count-1 for pool threads and count
+ * for the thread calling pool_wait(), so per-worker state needs count + 1
+ * slots. */
+struct ThreadPool {
+    Worker *workers;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    Batch *head;
+    Batch *tail;
+    bool quit;
+};
+
+#ifdef GLTTY_HARFBUZZ
+/* Runs of cells shaped together: ones of the same font variant holding a
+ * single narrow codepoint past the space, cut at every SHAPE_RUN_MAX
+ * columns.
+ * The shape cache is direct mapped on a hash of the variant and run text,
+ * so it stays SHAPE_CACHE_SIZE runs however much text goes by; a run
+ * evicts the one in its slot. */
+#define SHAPE_RUN_MAX 64
+#define SHAPE_CACHE_SIZE 4096
+
+/* A shaped run: the glyph of each of its cells, as in RenderContext's
+ * `shaped`. `length` 0 is an empty slot. */
+typedef struct {
+    uint32_t hash;
+    uint8_t variant;
+    uint8_t length;
+    uint32_t text[SHAPE_RUN_MAX];
+    uint32_t glyphs[SHAPE_RUN_MAX];
+} ShapedRun;
+#endif
+
+/* Instances are built in bands of `band_rows` rows. Band i writes the cells
+ * of `spans` in its rows, minus blank ones when `skip_blank` is set, at
+ * `offsets[i]` in `out` and leaves their number in `counts[i]`. With
+ * `row_counts` each row instead goes to its slot of `columns` instances in
+ * `out` and leaves its number in `row_counts`. */
+typedef struct {
+    const Cells *cells;
+    const StyleTable *styles;
+    const GlyphCache *glyphs;
+    const uint32_t *shaped;
+    const unsigned char *highlight;
+    Damage *spans;
+    uint16_t *row_counts;
+    bool skip_blank;
+    Instance *out;
+    int band_rows;
+    int bands;
+    size_t offsets[INSTANCE_BANDS_MAX];
+    size_t counts[INSTANCE_BANDS_MAX];
+} InstanceJob;
+
+typedef struct {
+    GLuint program;
+    GLuint texture;
+    GLuint vao;
+    GLuint vbo;
+    GLuint palette_ubo;
+    GLuint style_buffer;
+    GLuint style_texture;
+    GLuint glyph_buffer;
+    GLuint glyph_texture;
+    /* Each variant's glyphs are packed into its layer of the atlas on
+     * shelves as tall as their tallest glyph. `glyph_data` mirrors the
+     * glyph buffer, GLYPH_FLOATS a glyph; ids [dirty_begin, dirty_end)
+     * changed since it was last uploaded. `glyph_variants` has bit v set
+     * once variant v of a glyph is rasterized, and `glyph_codepoints` is
+     * what it is a glyph of, 0 for the missing glyph. */
+    Font *font;
+    GlyphCache glyph_cache;
+    float *glyph_data;
+    uint8_t *glyph_variants;
+    uint32_t *glyph_codepoints;
+    uint32_t glyph_count;
+    uint32_t glyph_capacity;
+    uint32_t dirty_begin;
+    uint32_t dirty_end;
+    bool glyphs_grown;
+    uint32_t notdef;
+    int atlas_x[FONT_VARIANTS];
+    int atlas_y[FONT_VARIANTS];
+    int atlas_shelf[FONT_VARIANTS];
+    bool atlas_full;
+    /* The glyphs shaping gave cells, by physical row, 0 where a cell draws
+     * its own codepoint's glyph. NULL when text is not shaped. */
+    uint32_t *shaped;
+    int shaped_columns;
+    int shaped_rows;
+#ifdef GLTTY_HARFBUZZ
+    hb_font_t *shapers[FONT_VARIANTS];
+    hb_buffer_t *shape_buffer;
+    GlyphCache shaped_glyphs;
+    ShapedRun *shape_cache;
+#endif
+    GLint reverse_location;
+    GLint row_offset_location;
+    size_t count;
+    RenderMode mode;
+    int width;
+    int height;
+    int cell_width;
+    int cell_height;
+    int columns;
+    int rows;
+    GLuint grid_program;
+    GLuint grid_vao;
+    GLuint grid_texture;
+    GLint grid_reverse_location;
+    GLint grid_row_offset_location;
+    int grid_texture_columns;
+    int grid_texture_rows;
+    uint32_t *grid_row;
+    GLuint retained_program;
+    GLuint retained_fbo;
+    GLuint retained_texture;
+    GLint retained_reverse_location;
+    int retained_width;
+    int retained_height;
+    bool retained_reverse;
+    unsigned highlight_version;
+    float projection[16];
+    float palette[256 * 4];
+    unsigned style_version;
+    Instance *instances;
+    Instance *mapped;
+    GLsync fences[INSTANCE_REGIONS];
+    int region;
+    size_t instances_size;
+    size_t capacity;
+    ThreadPool *pool;
+    Batch batch;
+    InstanceJob job;
+    /* RENDER_INSTANCED keeps the instances of every physical row in its
+     * slot of `row_instances`, `row_counts` of them used, and rebuilds
+     * only damaged rows. Each frame draws the slots of a ring region with
+     * one indirect draw of `commands`; bit i of `row_stale` marks a row
+     * whose copy in region i is out of date. */
+    Instance *row_instances;
+    uint16_t *row_counts;
+    uint8_t *row_stale;
+    DrawCommand *commands;
+    GLuint indirect;
+} RenderContext;
+
+/* Logical lines that scrolled off the top, stored as '\n'-terminated text.
+ * Blocks are never modified once sealed (every block but the last), so
+ * search workers can read them without locking. Sealing a block queues a
+ * build of its trigram bloom filter; `bloom` may only be read once
+ * `index_batch` is done. */
+typedef struct {
+    size_t first_line;
+    size_t lines;
+    size_t size;
+    size_t capacity;
+    Batch index_batch;
+    uint8_t *bloom;
+    char data[];
+} ScrollbackBlock;
+
+/* Counts the rows sealed blocks [0, count) wrap into at `columns`, a block
+ * per task. Workers only write `rows`, which is read once `batch` is done. */
+typedef struct ReflowJob {
+    int columns;
+    ScrollbackBlock **blocks;
+    size_t *rows;
+    size_t count;
+    Batch batch;
+    struct ReflowJob *next;
+} ReflowJob;
+
+#define SCROLLBACK_ROWS_UNKNOWN SIZE_MAX
+
+/* History is shown wrapped at `columns`. Lines are stored unwrapped, so a
+ * width change only invalidates `block_rows`, the number of rows each
+ * block wraps into: the view counts the blocks it needs on demand and
+ * `reflow` counts the rest in the background. */
+typedef struct {
+    ThreadPool *pool;
+    ScrollbackBlock **blocks;
+    size_t capacity;
+    size_t count;
+    size_t lines;
+    char *pending;
+    size_t pending_size;
+    size_t pending_capacity;
+    int columns;
+    size_t *block_rows;
+    ReflowJob *reflow;
+    ReflowJob *retired;
+} Scrollback;
+
+typedef struct {
+    size_t line;
+    size_t column;
+    size_t length;
+} SearchMatch;
+
+typedef struct {
+    SearchMatch *items;
+    size_t capacity;
+    size_t count;
+} SearchMatches;
+
+typedef struct Search Search;
+
+typedef struct SearchJob {
+    Search *search;
+    char query[SEARCH_QUERY_MAX + 1];
+    size_t query_size;
+    bool regex;
+    ScrollbackBlock **blocks;
+    uint32_t trigrams[SEARCH_QUERY_MAX];
+    size_t trigram_count;
+    regex_t *regexes;
+    bool *compiled;
+    int workers;
+    bool cancelled;
+    Batch batch;
+    struct SearchJob *next;
+} SearchJob;
+
+/* Scrollback matches stream in from the pool into `matches` under `lock`;
+ * matches on the visible screen are found synchronously into `highlight`.
+ * `at_line` and `at_column` are the match the prompt's Up and Down keys
+ * last moved the view to, SIZE_MAX for the live screen. */
+struct Search {
+    ThreadPool *pool;
+    bool prompt;
+    bool active;
+    bool regex;
+    bool invalid;
+    char query[SEARCH_QUERY_MAX + 1];
+    size_t query_size;
+    regex_t compiled;
+    bool compiled_valid;
+    pthread_mutex_t lock;
+    SearchMatches matches;
+    SearchJob *job;
+    SearchJob *retired;
+    unsigned char *highlight;
+    size_t highlight_size;
+    unsigned highlight_version;
+    size_t screen_matches;
+    size_t at_line;
+    size_t at_column;
+    size_t reported_matches;
+    bool reported_done;
+    bool title_stale;
+};
+
+/* The main thread handles window events and input, the tty thread parses
+ * pty output and the render thread owns the GL context. `lock` guards the
+ * terminal, cells, scrollback and search state and the framebuffer size;
+ * every change to what is on screen bumps `generation` and signals
+ * `changed`. `input_time` is when
+ * the oldest unanswered input was sent to the pty and `echo_time` the
+ * same time once output arrived after it, for latency measurement.
+ * While `iconified` nothing is rendered and damage keeps accumulating for
+ * the first frame after restore. */
+typedef struct {
+    int master;
+    Terminal *terminal;
+    Cells *cells;
+    Scrollback *scrollback;
+    Search *search;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned generation;
+    bool quit;
+    bool iconified;
+    bool focused;
+    double input_time;
+    double echo_time;
+    int width;
+    int height;
+    int cell_width;
+    int cell_height;
+    /* History rows the view is scrolled back by, 0 for the live screen. */
+    size_t view;
+    /* Main thread only: when the grid last changed size, 0 once the child
+     * has been told. */
+    double resize_time;
+} App;
+
+/* The render thread's private copy of the screen. Only damaged spans are
+ * copied in; of `terminal` only rows, columns, reverse and the style
+ * array are kept. `source` is the screen last copied from, so a switch
+ * to the other screen is seen as a change of pointer. */
+typedef struct {
+    Cells cells;
+    const Cells *source;
+    Terminal terminal;
+    unsigned char *highlight;
+    unsigned highlight_version;
+    bool highlighted;
+    double input_time;
+    int width;
+    int height;
+    size_t view;
+} Snapshot;
+
+/* PRESENT_LATENCY keeps vsync but sleeps until just before the vblank,
+ * less the estimated frame cost, before taking the snapshot. */
+typedef enum {
+    PRESENT_VSYNC,
+    PRESENT_IMMEDIATE,
+    PRESENT_LATENCY,
+} PresentMode;
+
+#define PRESENT_MARGIN 0.001
+#define LATENCY_REPORT_FRAMES 32
+/* Minimum time between frames while the window is unfocused. */
+#define UNFOCUSED_FRAME_INTERVAL 0.1
+/* How long the grid size has to stay put before the child is told. */
+#define RESIZE_DEBOUNCE 0.1
+
+typedef struct {
+    App *app;
+    GLFWwindow *window;
+    Font *font;
+    RenderMode mode;
+    PresentMode present;
+    double refresh_period;
+    ThreadPool *pool;
+} RenderThread;
+
+/* One instance per non-empty cell, drawn as a 4 vertex strip covering the
+ * whole cell. Instances carry physical rows; `row_offset` maps them to the
+ * screen. */
 static const char *vertex_src = {
 "#version 330 core\n"
-"layout (location = 0) in vec4 a_vert;\n"
-"out vec2 v_tex_coords;\n"
+"layout (location = 0) in uvec2 a_cell;\n"
+"layout (location = 1) in uint a_glyph;\n"
+"layout (location = 2) in uint a_style;\n"
+"out vec2 v_cell;\n"
+"flat out uint v_glyph;\n"
+"flat out uint v_style;\n"
 "uniform mat4 projection;\n"
+"uniform vec2 cell_size;\n"
+"uniform int rows;\n"
+"uniform int row_offset;\n"
 "void main()\n"
 "{\n"
-"    gl_Position = projection * vec4(a_vert.xy, 0, 1.0);\n"
-"    v_tex_coords = a_vert.zw;\n"
+"    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+"    int row = (int(a_cell.y) - row_offset + rows) % rows;\n"
+"    vec2 origin = vec2(a_cell.x, rows - 1 - row) * cell_size;\n"
+"    v_cell = corner * cell_size;\n"
+"    v_glyph = a_glyph;\n"
+"    v_style = a_style;\n"
+"    gl_Position = projection * vec4(origin + v_cell, 0, 1.0);\n"
+"}\n"
+};
+
+/* Shared by both renderers. Styles are resolved here: `styles` holds (fg,
+ * bg, underline, attrs) per style id and `Palette` the 256 indexed colors,
+ * so palette changes and reverse video only touch uniforms. `glyphs` holds
+ * two texels per glyph and font variant, its atlas rectangle and its box in
+ * cell pixels; the variant, bold and italic, is the layer of the `text`
+ * atlas the glyph is in.
+ * shade() composites glyph coverage over background and decorations and
+ * returns a color with straight alpha. */
+static const char *shade_src = {
+"#version 330 core\n"
+"uniform sampler2DArray text;\n"
+"uniform usamplerBuffer styles;\n"
+"uniform samplerBuffer glyphs;\n"
+"layout (std140) uniform Palette {\n"
+"    vec4 colors[256];\n"
+"};\n"
+"uniform vec3 default_fg;\n"
+"uniform vec3 default_bg;\n"
+"uniform vec3 highlight;\n"
+"uniform bool reverse;\n"
+"uniform vec2 cell_size;\n"
+
+"vec3 resolve(uint c, vec3 def, bool bright)\n"
+"{\n"
+"    uint type = c >> 24;\n"
+"    if (type == 1u) {\n"
+"        uint index = c & 0xffu;\n"
+"        if (bright && index < 8u)\n"
+"            index += 8u;\n"
+"        return colors[index].rgb;\n"
+"    }\n"
+"    if (type == 2u)\n"
+"        return vec3((c >> 16) & 0xffu, (c >> 8) & 0xffu, c & 0xffu) / 255.0;\n"
+"    return def;\n"
+"}\n"
+"vec3 background()\n"
+"{\n"
+"    return reverse ? default_fg : default_bg;\n"
+"}\n"
+"vec4 shade(uint glyph, uint style_id, vec2 cell)\n"
+"{\n"
+"    uvec4 style = texelFetch(styles, int(style_id & 0xffffu));\n"
+"    uint attrs = style.w;\n"
+"    vec3 dfg = reverse ? default_bg : default_fg;\n"
+"    vec3 fg = resolve(style.x, dfg, (attrs & 1u) != 0u);\n"
+"    vec3 bg = resolve(style.y, background(), false);\n"
+"    bool has_bg = style.y != 0u;\n"
+"    if ((attrs & 16u) != 0u) {\n"
+"        vec3 tmp = fg;\n"
+"        fg = bg;\n"
+"        bg = tmp;\n"
+"        has_bg = true;\n"
+"    }\n"
+"    if ((attrs & 2u) != 0u)\n"
+"        fg = mix(bg, fg, 0.5);\n"
+"    if ((style_id & 0x10000u) != 0u)\n"
+"        fg = highlight;\n"
+"\n"
+"    vec3 base = bg;\n"
+"    float base_alpha = has_bg ? 1.0 : 0.0;\n"
+"    float y = 1.0 - cell.y / cell_size.y;\n"
+"    if ((attrs & 8u) != 0u && y > 0.88 && y < 0.94) {\n"
+"        base = style.z != 0u ? resolve(style.z, fg, false) : fg;\n"
+"        base_alpha = 1.0;\n"
+"    } else if ((attrs & 32u) != 0u && y > 0.52 && y < 0.58) {\n"
+"        base = fg;\n"
+"        base_alpha = 1.0;\n"
+"    }\n"
+"\n"
+"    float coverage = 0.0;\n"
+"    if (glyph != 0u) {\n"
+"        vec2 p = cell + vec2(float(int(glyph) >> 28) * cell_size.x, 0.0);\n"
+"        int layer = int((attrs & 1u) | ((attrs >> 1) & 2u));\n"
+"        int slot = (int(glyph & 0x0fffffffu) * 4 + layer) * 2;\n"
+"        vec4 uv = texelFetch(glyphs, slot);\n"
+"        vec4 box = texelFetch(glyphs, slot + 1);\n"
+"        vec2 g = (p - box.xy) / box.zw;\n"
+"        if (all(greaterThanEqual(g, vec2(0.0))) && all(lessThan(g, vec2(1.0))))\n"
+"            coverage = texture(text, vec3(mix(uv.x, uv.z, g.x), mix(uv.w, uv.y, g.y), layer)).r;\n"
+"    }\n"
+"    float alpha = base_alpha + coverage * (1.0 - base_alpha);\n"
+"    vec3 color = fg;\n"
+"    if (alpha > 0.0)\n"
+"        color = (base * base_alpha * (1.0 - coverage) + fg * coverage) / alpha;\n"
+"    return vec4(color, alpha);\n"
 "}\n"
 };
 
 static const char *fragment_src = {
+"in vec2 v_cell;\n"
+"flat in uint v_glyph;\n"
+"flat in uint v_style;\n"
+"out vec4 frag_color;\n"
+"void main()\n"
+"{\n"
+"    frag_color = shade(v_glyph, v_style, v_cell);\n"
+"}\n"
+};
+
+/* The retained renderer overwrites whole cells, so it composites over the
+ * background itself and writes opaque pixels. */
+static const char *retained_fragment_src = {
+"in vec2 v_cell;\n"
+"flat in uint v_glyph;\n"
+"flat in uint v_style;\n"
+"out vec4 frag_color;\n"
+"void main()\n"
+"{\n"
+"    vec4 c = shade(v_glyph, v_style, v_cell);\n"
+"    frag_color = vec4(mix(background(), c.rgb, c.a), 1.0);\n"
+"}\n"
+};
+
+/* The GPU resident grid: a single triangle covering the viewport. */
+static const char *grid_vertex_src = {
 "#version 330 core\n"
-"in vec2 v_tex_coords;\n"
+"void main()\n"
+"{\n"
+"    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+"    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+"}\n"
+};
+
+/* `grid` holds (glyph, style) per cell in physical row order; logical row 0,
+ * at the top of the window, is physical row `row_offset`. The texture may
+ * be larger than the `columns` x `rows` in use. */
+static const char *grid_fragment_src = {
 "out vec4 frag_color;\n"
-"uniform sampler2D text;\n"
+"uniform usampler2D grid;\n"
+"uniform int columns;\n"
+"uniform int rows;\n"
+"uniform int row_offset;\n"
+"uniform float height;\n"
 "void main()\n"
 "{\n"
-"    frag_color = vec4(1.0, 1.0, 1.0, texture(text, v_tex_coords).r);\n"
+"    vec2 p = vec2(gl_FragCoord.x, height - gl_FragCoord.y);\n"
+"    ivec2 pos = ivec2(p / cell_size);\n"
+"    if (pos.x >= columns || pos.y >= rows) {\n"
+"        frag_color = vec4(background(), 1.0);\n"
+"        return;\n"
+"    }\n"
+"    uvec2 cell = texelFetch(grid, ivec2(pos.x, (pos.y + row_offset) % rows), 0).xy;\n"
+"    vec2 local = vec2(p.x - pos.x * cell_size.x, (pos.y + 1) * cell_size.y - p.y);\n"
+"    vec4 c = shade(cell.x, cell.y, local);\n"
+"    frag_color = vec4(mix(background(), c.rgb, c.a), 1.0);\n"
 "}\n"
 };
 
@@ -130,279 +870,3923 @@ static void log_info(const char *format, ...)
     fflush(stdout);
 }
 
-static void font_init(Font *font, const char *font_path, int font_size)
+static void pool_worker_run(ThreadPool *pool, Batch *batch, size_t task,
+                            int worker);
+
+static bool pool_take(ThreadPool *pool, Batch *only, Batch **batch, size_t *task)
+{
+    Batch *prev = NULL;
+    Batch *b = pool->head;
+    while (b && only && b != only) {
+        prev = b;
+        b = b->queue_next;
+    }
+    if (!b)
+        return false;
+    *batch = b;
+    *task = b->next++;
+    if (b->next == b->count) {
+        if (prev)
+            prev->queue_next = b->queue_next;
+        else
+            pool->head = b->queue_next;
+        if (pool->tail == b)
+            pool->tail = prev;
+    }
+    return true;
+}
+
+static void *pool_worker(void *arg)
+{
+    Worker *w = arg;
+    ThreadPool *pool = w->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        Batch *batch;
+        size_t task;
+        while (!pool->quit && !pool_take(pool, NULL, &batch, &task))
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->quit)
+            break;
+        pool_worker_run(pool, batch, task, w->index);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Called and returns with pool->lock held. */
+static void pool_worker_run(ThreadPool *pool, Batch *batch, size_t task,
+                            int worker)
+{
+    pthread_mutex_unlock(&pool->lock);
+    batch->func(batch->arg, task, worker);
+    pthread_mutex_lock(&pool->lock);
+    if (++batch->finished == batch->count)
+        pthread_cond_broadcast(&pool->done);
+}
+
+static void pool_init(ThreadPool *pool)
+{
+    memset(pool, 0, sizeof(ThreadPool));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->count = cpus > 1 ? cpus : 1;
+    pool->workers = malloc(sizeof(Worker) * pool->count);
+    if (pool->workers == NULL)
+        fatal("Malloc failed.");
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < pool->count; i++) {
+        Worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        if (pthread_create(&w->thread, NULL, pool_worker, w) != 0)
+            fatal("pthread_create() failed.");
+    }
+    log_info("Thread pool: %d workers", pool->count);
+}
+
+static void pool_submit(ThreadPool *pool, Batch *batch, TaskFunc func,
+                        void *arg, size_t count)
+{
+    batch->func = func;
+    batch->arg = arg;
+    batch->count = count;
+    batch->next = 0;
+    batch->finished = 0;
+    batch->queue_next = NULL;
+    if (count == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->queue_next = batch;
+    else
+        pool->head = batch;
+    pool->tail = batch;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static bool pool_done(ThreadPool *pool, const Batch *batch)
+{
+    pthread_mutex_lock(&pool->lock);
+    bool done = batch->finished == batch->count;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+/* Runs tasks of `batch` on the calling thread too, until all are done. */
+static void pool_wait(ThreadPool *pool, Batch *batch)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (batch->finished != batch->count) {
+        Batch *b;
+        size_t task;
+        if (pool_take(pool, batch, &b, &task))
+            pool_worker_run(pool, b, task, pool->count);
+        else
+            pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline bool is_printable_ascii(char c)
+{
+    return (c >= ASCII_BEGIN) && (c <= ASCII_END);
+}
+
+static inline Cell cell_make(uint32_t codepoint, uint16_t style, uint32_t flags)
+{
+    return (Cell) codepoint | ((Cell) style << CELL_STYLE_SHIFT) |
+           ((Cell) flags << CELL_FLAGS_SHIFT);
+}
+
+static inline uint32_t cell_codepoint(Cell cell)
+{
+    return cell & CELL_CODEPOINT_MASK;
+}
+
+static inline uint16_t cell_style(Cell cell)
+{
+    return cell >> CELL_STYLE_SHIFT;
+}
+
+static inline uint32_t cell_flags(Cell cell)
+{
+    return cell >> CELL_FLAGS_SHIFT;
+}
+
+static inline uint32_t cell_cluster(Cell cell)
+{
+    return cell_flags(cell) >> CELL_CLUSTER_SHIFT;
+}
+
+/* Columns taken by `codepoint`, which must be below 0x110000: 0, 1 or 2. */
+static inline int codepoint_width(uint32_t codepoint)
+{
+    const uint8_t block = width_stage1[codepoint >> UNICODE_BLOCK_SHIFT];
+    const uint8_t byte = width_stage2[block][(codepoint & UNICODE_BLOCK_MASK) >> 2];
+    return byte >> (codepoint & 3) * 2 & 3;
+}
+
+/* Grapheme_Cluster_Break property of `codepoint`, with Extended_Pictographic
+ * as GRAPHEME_PICTOGRAPHIC. */
+static inline int grapheme_property(uint32_t codepoint)
+{
+    const uint8_t block = grapheme_stage1[codepoint >> UNICODE_BLOCK_SHIFT];
+    const uint8_t byte = grapheme_stage2[block][(codepoint & UNICODE_BLOCK_MASK) >> 1];
+    return byte >> (codepoint & 1) * 4 & 0xf;
+}
+
+/* Whether a codepoint with break property `next` continues the cluster
+ * behind `s`, by rules GB4 to GB13 of UAX #29. */
+static bool grapheme_continues(const Segmenter *s, int next)
+{
+    const int last = s->last;
+    if (last == GRAPHEME_CONTROL || last == GRAPHEME_CR || last == GRAPHEME_LF ||
+        next == GRAPHEME_CONTROL || next == GRAPHEME_CR || next == GRAPHEME_LF)
+        return false;
+    if (next == GRAPHEME_EXTEND || next == GRAPHEME_ZWJ || next == GRAPHEME_SPACING_MARK)
+        return true;
+    switch (last) {
+        case GRAPHEME_PREPEND:
+            return true;
+        case GRAPHEME_L:
+            return next == GRAPHEME_L || next == GRAPHEME_V ||
+                   next == GRAPHEME_LV || next == GRAPHEME_LVT;
+        case GRAPHEME_LV:
+        case GRAPHEME_V:
+            return next == GRAPHEME_V || next == GRAPHEME_T;
+        case GRAPHEME_LVT:
+        case GRAPHEME_T:
+            return next == GRAPHEME_T;
+        case GRAPHEME_ZWJ:
+            return next == GRAPHEME_PICTOGRAPHIC && s->pictographic;
+        case GRAPHEME_REGIONAL_INDICATOR:
+            return next == GRAPHEME_REGIONAL_INDICATOR && s->regional_odd;
+    }
+    return false;
+}
+
+/* Moves `s` past a codepoint with break property `next`, which starts a
+ * new cluster unless `continues`. */
+static void segmenter_push(Segmenter *s, int next, bool continues)
+{
+    if (next == GRAPHEME_PICTOGRAPHIC)
+        s->pictographic = true;
+    else if (!continues || s->last == GRAPHEME_ZWJ ||
+             (next != GRAPHEME_EXTEND && next != GRAPHEME_ZWJ))
+        s->pictographic = false;
+    s->regional_odd = next == GRAPHEME_REGIONAL_INDICATOR &&
+                      !(continues && s->regional_odd);
+    s->last = next;
+}
+
+/* Whether `next` joining a narrow cluster that starts with `first` makes it
+ * wide: an emoji presentation selector after a pictograph, or the second
+ * regional indicator of a flag. */
+static inline bool cluster_widens(uint32_t first, uint32_t next)
+{
+    const int property = grapheme_property(first);
+    return (next == 0xfe0f && property == GRAPHEME_PICTOGRAPHIC) ||
+           (property == GRAPHEME_REGIONAL_INDICATOR &&
+            grapheme_property(next) == GRAPHEME_REGIONAL_INDICATOR);
+}
+
+static size_t utf8_encode(uint32_t codepoint, char *out)
+{
+    if (codepoint < 0x80) {
+        out[0] = codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800) {
+        out[0] = 0xc0 | codepoint >> 6;
+        out[1] = 0x80 | (codepoint & 0x3f);
+        return 2;
+    }
+    if (codepoint < 0x10000) {
+        out[0] = 0xe0 | codepoint >> 12;
+        out[1] = 0x80 | (codepoint >> 6 & 0x3f);
+        out[2] = 0x80 | (codepoint & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | codepoint >> 18;
+    out[1] = 0x80 | (codepoint >> 12 & 0x3f);
+    out[2] = 0x80 | (codepoint >> 6 & 0x3f);
+    out[3] = 0x80 | (codepoint & 0x3f);
+    return 4;
+}
+
+/* Starts a sequence at lead byte `byte`. Returns its length, or 0 if the
+ * byte cannot start one. */
+static inline int utf8_lead(unsigned char byte, uint32_t *codepoint)
+{
+    if (byte < 0x80) {
+        *codepoint = byte;
+        return 1;
+    }
+    if (byte >= 0xc2 && byte <= 0xdf) {
+        *codepoint = byte & 0x1f;
+        return 2;
+    }
+    if (byte >= 0xe0 && byte <= 0xef) {
+        *codepoint = byte & 0x0f;
+        return 3;
+    }
+    if (byte >= 0xf0 && byte <= 0xf4) {
+        *codepoint = byte & 0x07;
+        return 4;
+    }
+    return 0;
+}
+
+/* Rejects overlong forms, surrogates and codepoints past U+10FFFF. */
+static inline bool utf8_valid(uint32_t codepoint, int length)
+{
+    static const uint32_t min[5] = {0, 0, 0x80, 0x800, 0x10000};
+    return codepoint >= min[length] && codepoint <= 0x10ffff &&
+           (codepoint < 0xd800 || codepoint > 0xdfff);
+}
+
+/* Decodes one codepoint of complete text, returning the bytes consumed.
+ * Malformed input decodes to U+FFFD a byte at a time. */
+static size_t utf8_decode(const char *p, const char *end, uint32_t *codepoint)
+{
+    const int length = utf8_lead(*p, codepoint);
+    if (length == 1)
+        return 1;
+    if (length == 0 || end - p < length) {
+        *codepoint = REPLACEMENT_CHARACTER;
+        return 1;
+    }
+    for (int i = 1; i < length; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *codepoint = REPLACEMENT_CHARACTER;
+            return 1;
+        }
+        *codepoint = *codepoint << 6 | (p[i] & 0x3f);
+    }
+    if (!utf8_valid(*codepoint, length))
+        *codepoint = REPLACEMENT_CHARACTER;
+    return length;
+}
+
+/* True if no byte has its high bit set, 16 bytes a step with SSE2. */
+static bool text_is_ascii(const char *text, size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16)
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (text + i))))
+            return false;
+#endif
+    for (; i < size; i++)
+        if (text[i] & 0x80)
+            return false;
+    return true;
+}
+
+/* Sorts the fonts matching the configured pattern with the weight and
+ * slant of `variant`. Returns false if nothing matches. */
+static bool font_chain_init(Font *font, int variant)
+{
+    FontChain *chain = &font->chains[variant];
+    FcPattern *pattern = FcPatternDuplicate(font->pattern);
+    if (pattern == NULL)
+        fatal("Malloc failed.");
+    if (variant & FONT_BOLD) {
+        FcPatternDel(pattern, FC_WEIGHT);
+        FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+    }
+    if (variant & FONT_ITALIC) {
+        FcPatternDel(pattern, FC_SLANT);
+        FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
+    }
+    FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+    FcResult result;
+    chain->fallbacks = FcFontSort(NULL, pattern, FcTrue, NULL, &result);
+    FcPatternDestroy(pattern);
+    if (chain->fallbacks == NULL || chain->fallbacks->nfont == 0)
+        return false;
+    chain->faces = calloc(chain->fallbacks->nfont, sizeof(FontFace));
+    if (chain->faces == NULL)
+        fatal("Malloc failed.");
+    return true;
+}
+
+/* The chain of `variant`, matched on first use. A variant nothing matches
+ * takes the regular chain and is synthesized from it. */
+static FontChain *font_chain(Font *font, int variant)
+{
+    FontChain *chain = &font->chains[variant];
+    if (chain->fallbacks == NULL && !font_chain_init(font, variant)) {
+        log_info("No font for style variant %d, synthesizing it.", variant);
+        *chain = font->chains[FONT_REGULAR];
+    }
+    return chain;
+}
+
+/* Opens fallback i of `chain` at the size of the primary face. Faces that
+ * cannot be scaled, bitmap only ones, are given up on. */
+static FT_Face font_face(Font *font, FontChain *chain, int i)
+{
+    FontFace *f = &chain->faces[i];
+    if (f->face || f->failed)
+        return f->face;
+    FcChar8 *file;
+    int index = 0;
+    FcPattern *pattern = chain->fallbacks->fonts[i];
+    if (FcPatternGetString(pattern, FC_FILE, 0, &file) != FcResultMatch) {
+        f->failed = true;
+        return NULL;
+    }
+    FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
+    FT_Face face;
+    if (FT_New_Face(font->library, (const char *) file, index, &face)) {
+        log_info("Failed to load font: %s", file);
+        f->failed = true;
+        return NULL;
+    }
+    if (FT_Set_Char_Size(face, 0, font->size * 64, 96, 96)) {
+        FT_Done_Face(face);
+        f->failed = true;
+        return NULL;
+    }
+    f->face = face;
+    return face;
+}
+
+/* The first face of the `variant` chain whose character set has
+ * `codepoint`, or NULL if none does. Only faces that are asked for get
+ * opened. */
+static FT_Face font_select(Font *font, int variant, uint32_t codepoint)
+{
+    FontChain *chain = font_chain(font, variant);
+    for (int i = 0; i < chain->fallbacks->nfont; i++) {
+        FcCharSet *charset;
+        if (FcPatternGetCharSet(chain->fallbacks->fonts[i], FC_CHARSET, 0,
+                                &charset) != FcResultMatch ||
+            !FcCharSetHasChar(charset, codepoint))
+            continue;
+        FT_Face face = font_face(font, chain, i);
+        if (face && FT_Get_Char_Index(face, codepoint))
+            return face;
+    }
+    return NULL;
+}
+
+/* The first face of the `variant` chain that opens. */
+static FT_Face font_primary(Font *font, int variant)
+{
+    FontChain *chain = font_chain(font, variant);
+    for (int i = 0; i < chain->fallbacks->nfont; i++) {
+        FT_Face face = font_face(font, chain, i);
+        if (face)
+            return face;
+    }
+    return font->chains[FONT_REGULAR].faces[0].face;
+}
+
+/* `name` is a fontconfig pattern such as "JetBrains Mono,monospace". Its
+ * best match has to be monospace; the rest of the sorted matches are
+ * fallbacks for codepoints it lacks. */
+static void font_init(Font *font, const char *name, int font_size)
+{
+    if (!FcInit())
+        fatal("Failed to init fontconfig.");
+    if (FT_Init_FreeType(&font->library))
+        fatal("Failed to init FreeType2.");
+    font->pattern = FcNameParse((const FcChar8 *) name);
+    if (font->pattern == NULL)
+        fatal("Bad font name: %s", name);
+    if (!font_chain_init(font, FONT_REGULAR))
+        fatal("No font matches: %s", name);
+    font->size = font_size;
+
+    FontChain *chain = &font->chains[FONT_REGULAR];
+    FT_Face face = font_face(font, chain, 0);
+    if (face == NULL)
+        fatal("Failed to load font: %s", name);
+    if (!FT_IS_FIXED_WIDTH(face))
+        fatal("Font should be a monospace font.");
+    if (FT_Load_Char(face, 'M', FT_LOAD_DEFAULT))
+        fatal("Failed to load char: M");
+    font->char_width = face->glyph->advance.x >> 6;
+    font->char_height= (face->size->metrics.ascender - face->size->metrics.descender)>> 6;
+    font->descent = -face->size->metrics.descender >> 6;
+}
+
+static void check_shader_errors(GLuint shader, GLenum type)
+{
+    GLint success = 0;
+    GLint info_log_length = 0;
+    char *info_log = NULL;
+
+    if (type == GL_VERTEX_SHADER || type == GL_FRAGMENT_SHADER) {
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if (!success) {
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
+            info_log = malloc(info_log_length);
+            info_log[info_log_length - 1] = '\0';
+            glGetShaderInfoLog(shader, info_log_length, NULL, info_log);
+            if (type == GL_VERTEX_SHADER)
+                fatal("Vertex shader error: \n%s", info_log);
+            else
+                fatal("Fragment shader error: \n%s", info_log);
+        }
+    } else if(type == GL_PROGRAM) {
+        glGetProgramiv(shader, GL_LINK_STATUS, &success);
+        if (!success) {
+            glGetProgramiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
+            info_log = malloc(info_log_length);
+            info_log[info_log_length - 1] = '\0';
+            glGetProgramInfoLog(shader, info_log_length, NULL, info_log);
+            fatal("Shader program linking error: \n%s", info_log);
+        }
+    }
+}
+
+/* The fragment shader is built from the shared shade_src followed by
+ * `fragment_src`. */
+static GLuint create_shader_program(const char *vertex_src,
+                                    const char *fragment_src)
+{
+    GLuint vertex = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex, 1, (const GLchar * const *) &vertex_src, NULL);
+    glCompileShader(vertex);
+    check_shader_errors(vertex, GL_VERTEX_SHADER);
+
+    GLuint fragment = glCreateShader(GL_FRAGMENT_SHADER);
+    const char *fragment_srcs[] = {shade_src, fragment_src};
+    glShaderSource(fragment, 2, (const GLchar * const *) fragment_srcs, NULL);
+    glCompileShader(fragment);
+    check_shader_errors(fragment, GL_FRAGMENT_SHADER);
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    check_shader_errors(program, GL_PROGRAM);
+
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    return program;
+}
+
+static void ortho(float *m, float left, float right, float bottom, float top,
+                  float near, float far)
+{
+    memset(m, 0, 16 * sizeof(float));
+    m[0] = 2 / (right - left);
+    m[5] = 2 / (top - bottom);
+    m[10] = 2 / (near - far);
+    m[15] = 1;
+    m[12] = (right + left) / (left - right);
+    m[13] = (top + bottom) / (bottom - top);
+    m[14] = (far + near) / (near - far);
+}
+
+
+static inline uint32_t glyph_lookup(const GlyphCache *cache, uint32_t codepoint)
+{
+    if (codepoint < GLYPH_BMP)
+        return cache->bmp[codepoint];
+    if (cache->capacity == 0)
+        return 0;
+    const size_t mask = cache->capacity - 1;
+    size_t slot = (codepoint * 0x9e3779b1u) >> 7 & mask;
+    while (cache->keys[slot]) {
+        if (cache->keys[slot] == codepoint)
+            return cache->values[slot];
+        slot = (slot + 1) & mask;
+    }
+    return 0;
+}
+
+/* Astral codepoints are never 0, so 0 marks a free slot. The hash is kept
+ * at most half full. */
+static void glyph_cache_insert(GlyphCache *cache, uint32_t codepoint,
+                               uint32_t glyph)
+{
+    if (codepoint < GLYPH_BMP) {
+        cache->bmp[codepoint] = glyph;
+        return;
+    }
+    if (cache->count * 2 >= cache->capacity) {
+        GlyphCache old = *cache;
+        cache->capacity = old.capacity ? old.capacity * 2 : 256;
+        cache->keys = calloc(cache->capacity, sizeof(uint32_t));
+        cache->values = malloc(sizeof(uint32_t) * cache->capacity);
+        if (cache->keys == NULL || cache->values == NULL)
+            fatal("Malloc failed.");
+        cache->count = 0;
+        for (size_t i = 0; i < old.capacity; i++)
+            if (old.keys[i])
+                glyph_cache_insert(cache, old.keys[i], old.values[i]);
+        free(old.keys);
+        free(old.values);
+    }
+    const size_t mask = cache->capacity - 1;
+    size_t slot = (codepoint * 0x9e3779b1u) >> 7 & mask;
+    while (cache->keys[slot])
+        slot = (slot + 1) & mask;
+    cache->keys[slot] = codepoint;
+    cache->values[slot] = glyph;
+    cache->count++;
+}
+
+/* Adds a glyph id for `codepoint` with no variant rasterized yet. */
+static uint32_t glyph_new(RenderContext *rc, uint32_t codepoint)
+{
+    if (rc->glyph_count == rc->glyph_capacity) {
+        rc->glyph_capacity = rc->glyph_capacity ? rc->glyph_capacity * 2 : 256;
+        rc->glyph_data = realloc(rc->glyph_data, sizeof(float) * GLYPH_FLOATS * rc->glyph_capacity);
+        rc->glyph_variants = realloc(rc->glyph_variants, rc->glyph_capacity);
+        rc->glyph_codepoints = realloc(rc->glyph_codepoints, sizeof(uint32_t) * rc->glyph_capacity);
+        if (!rc->glyph_data || !rc->glyph_variants || !rc->glyph_codepoints)
+            fatal("Realloc failed.");
+        rc->glyphs_grown = true;
+    }
+    const uint32_t id = rc->glyph_count++;
+    memset(rc->glyph_data + id * GLYPH_FLOATS, 0, sizeof(float) * GLYPH_FLOATS);
+    rc->glyph_variants[id] = 0;
+    rc->glyph_codepoints[id] = codepoint;
+    return id;
+}
+
+/* Sets variant `variant` of glyph `id`: its atlas rectangle and its box in
+ * cell pixels. */
+static void glyph_set(RenderContext *rc, uint32_t id, int variant,
+                      const float *data)
+{
+    memcpy(rc->glyph_data + id * GLYPH_FLOATS + variant * 8, data, sizeof(float) * 8);
+    rc->glyph_variants[id] |= 1u << variant;
+    if (rc->dirty_begin >= rc->dirty_end) {
+        rc->dirty_begin = id;
+        rc->dirty_end = id + 1;
+    } else {
+        if (id < rc->dirty_begin)
+            rc->dirty_begin = id;
+        if (id + 1 > rc->dirty_end)
+            rc->dirty_end = id + 1;
+    }
+}
+
+/* Rasterizes glyph `index` of `face` as variant `variant` of glyph `id`,
+ * for a cell `columns` wide. A face without the variant's weight or slant
+ * is emboldened or slanted by FreeType. The bitmap is packed on the
+ * current shelf of the variant's atlas layer, or a new one, a texel apart
+ * from its neighbours so filtering does not bleed. Glyphs larger than
+ * their cells, as fallback faces can have, are scaled down to fit. Once a
+ * layer is full new glyphs are drawn empty. */
+static void glyph_render(RenderContext *rc, uint32_t id, int variant,
+                         FT_Face face, FT_UInt index, int columns)
+{
+    float g[8] = {0, 0, 0, 0, 0, 0, 1, 1};
+    if (FT_Load_Glyph(face, index, FT_LOAD_DEFAULT)) {
+        glyph_set(rc, id, variant, g);
+        return;
+    }
+    if ((variant & FONT_BOLD) && !(face->style_flags & FT_STYLE_FLAG_BOLD))
+        FT_GlyphSlot_Embolden(face->glyph);
+    if ((variant & FONT_ITALIC) && !(face->style_flags & FT_STYLE_FLAG_ITALIC))
+        FT_GlyphSlot_Oblique(face->glyph);
+    if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL) ||
+        face->glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+        glyph_set(rc, id, variant, g);
+        return;
+    }
+    const FT_Bitmap *bitmap = &face->glyph->bitmap;
+    const int width = bitmap->width;
+    const int height = bitmap->rows;
+    if (width == 0 || height == 0) {
+        glyph_set(rc, id, variant, g);
+        return;
+    }
+    if (rc->atlas_x[variant] + width > GLYPH_ATLAS_SIZE) {
+        rc->atlas_y[variant] += rc->atlas_shelf[variant] + 1;
+        rc->atlas_x[variant] = 0;
+        rc->atlas_shelf[variant] = 0;
+    }
+    if (width > GLYPH_ATLAS_SIZE || rc->atlas_y[variant] + height > GLYPH_ATLAS_SIZE) {
+        if (!rc->atlas_full)
+            log_info("Glyph atlas full, new glyphs are drawn empty.");
+        rc->atlas_full = true;
+        glyph_set(rc, id, variant, g);
+        return;
+    }
+
+    const int x = rc->atlas_x[variant];
+    const int y = rc->atlas_y[variant];
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->pitch);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, rc->texture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, variant, width, height, 1,
+                    GL_RED, GL_UNSIGNED_BYTE, bitmap->buffer);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    g[0] = x / (float) GLYPH_ATLAS_SIZE;
+    g[1] = y / (float) GLYPH_ATLAS_SIZE;
+    g[2] = (x + width) / (float) GLYPH_ATLAS_SIZE;
+    g[3] = (y + height) / (float) GLYPH_ATLAS_SIZE;
+    rc->atlas_x[variant] += width + 1;
+    if (height > rc->atlas_shelf[variant])
+        rc->atlas_shelf[variant] = height;
+
+    const float span = columns * rc->cell_width;
+    const float descent = rc->font->descent;
+    float scale = 1.0f;
+    if (width > span)
+        scale = span / width;
+    if (height * scale > rc->cell_height)
+        scale = rc->cell_height / (float) height;
+    g[4] = face->glyph->bitmap_left;
+    g[5] = descent - height + face->glyph->bitmap_top;
+    g[6] = width;
+    g[7] = height;
+    if (scale < 1.0f) {
+        g[6] = width * scale;
+        g[7] = height * scale;
+        g[4] = (span - g[6]) / 2;
+        g[5] = descent - (height - face->glyph->bitmap_top) * scale;
+        if (g[5] < 0)
+            g[5] = 0;
+        if (g[5] + g[7] > rc->cell_height)
+            g[5] = rc->cell_height - g[7];
+    }
+    glyph_set(rc, id, variant, g);
+}
+
+/* Rasterizes variant `variant` of glyph `id` from the first face of the
+ * variant's chain that has it, else from the regular chain, else as the
+ * variant's missing glyph. */
+static void glyph_variant(RenderContext *rc, uint32_t id, int variant)
+{
+    const uint32_t codepoint = rc->glyph_codepoints[id];
+    FT_Face face = NULL;
+    if (codepoint) {
+        face = font_select(rc->font, variant, codepoint);
+        if (face == NULL && variant != FONT_REGULAR)
+            face = font_select(rc->font, FONT_REGULAR, codepoint);
+    }
+    if (face == NULL) {
+        glyph_render(rc, id, variant, font_primary(rc->font, variant), 0, 1);
+        return;
+    }
+    glyph_render(rc, id, variant, face, FT_Get_Char_Index(face, codepoint),
+                 codepoint_width(codepoint) == 2 ? 2 : 1);
+}
+
+/* Gives a codepoint seen for the first time its glyph id. Codepoints no
+ * face has share the missing glyph. */
+static uint32_t glyph_resolve(RenderContext *rc, uint32_t codepoint)
+{
+    uint32_t glyph;
+    if (font_select(rc->font, FONT_REGULAR, codepoint)) {
+        glyph = glyph_new(rc, codepoint);
+    } else {
+        if (rc->notdef == 0)
+            rc->notdef = glyph_new(rc, 0);
+        glyph = rc->notdef;
+    }
+    glyph_cache_insert(&rc->glyph_cache, codepoint, glyph);
+    return glyph;
+}
+
+/* Sends the glyphs changed since the last upload, or all of them after
+ * the buffer had to grow. */
+static void upload_glyphs(RenderContext *rc)
+{
+    const size_t size = sizeof(float) * GLYPH_FLOATS;
+    glBindBuffer(GL_TEXTURE_BUFFER, rc->glyph_buffer);
+    if (rc->glyphs_grown) {
+        glBufferData(GL_TEXTURE_BUFFER, size * rc->glyph_capacity,
+                     rc->glyph_data, GL_DYNAMIC_DRAW);
+        rc->glyphs_grown = false;
+    } else if (rc->dirty_begin < rc->dirty_end) {
+        glBufferSubData(GL_TEXTURE_BUFFER, size * rc->dirty_begin,
+                        size * (rc->dirty_end - rc->dirty_begin),
+                        rc->glyph_data + rc->dirty_begin * GLYPH_FLOATS);
+    }
+    rc->dirty_begin = rc->dirty_end = 0;
+}
+
+/* Glyph 0 draws nothing, glyphs 1 to ASCII_COUNT are printable ASCII, of
+ * which the regular variant is rasterized up front, and GLYPH_EMPTY
+ * follows them. Texel (0, 0) of every atlas layer stays clear for glyphs
+ * without a bitmap. */
+static void init_glyphs(RenderContext *rc, Font *font)
+{
+    rc->font = font;
+    rc->glyph_cache.bmp = calloc(GLYPH_BMP, sizeof(uint32_t));
+    unsigned char *clear = calloc((size_t) GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, FONT_VARIANTS);
+    if (rc->glyph_cache.bmp == NULL || clear == NULL)
+        fatal("Malloc failed.");
+    glGenTextures(1, &rc->texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, rc->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE,
+                 FONT_VARIANTS, 0, GL_RED, GL_UNSIGNED_BYTE, clear);
+    free(clear);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    for (int v = 0; v < FONT_VARIANTS; v++)
+        rc->atlas_x[v] = 1;
+
+    const float empty[8] = {0, 0, 0, 0, 0, 0, 1, 1};
+    glyph_new(rc, 0);
+    for (int c = ASCII_BEGIN; c <= ASCII_END; c++)
+        glyph_variant(rc, glyph_new(rc, c), FONT_REGULAR);
+    glyph_new(rc, 0);
+    for (int v = 0; v < FONT_VARIANTS; v++)
+        glyph_set(rc, GLYPH_EMPTY, v, empty);
+
+    glGenBuffers(1, &rc->glyph_buffer);
+    glGenTextures(1, &rc->glyph_texture);
+    upload_glyphs(rc);
+    glBindTexture(GL_TEXTURE_BUFFER, rc->glyph_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, rc->glyph_buffer);
+}
+
+#ifdef GLTTY_HARFBUZZ
+static void init_shaping(RenderContext *rc)
+{
+    rc->shape_buffer = hb_buffer_create();
+    rc->shape_cache = calloc(SHAPE_CACHE_SIZE, sizeof(ShapedRun));
+    if (!hb_buffer_allocation_successful(rc->shape_buffer) || rc->shape_cache == NULL)
+        fatal("Malloc failed.");
+}
+#endif
+
+/* The xterm 256 color palette: 16 base colors, a 6x6x6 cube and 24 grays. */
+static void init_palette(float *palette)
+{
+    static const uint32_t base[16] = {
+        0x000000, 0xcd0000, 0x00cd00, 0xcdcd00,
+        0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+        0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00,
+        0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+    };
+    for (int i = 0; i < 256; i++) {
+        uint32_t rgb;
+        if (i < 16) {
+            rgb = base[i];
+        } else if (i < 232) {
+            static const uint32_t levels[6] = {0, 95, 135, 175, 215, 255};
+            const int n = i - 16;
+            rgb = levels[n / 36] << 16 | levels[(n / 6) % 6] << 8 | levels[n % 6];
+        } else {
+            const uint32_t gray = 8 + (i - 232) * 10;
+            rgb = gray << 16 | gray << 8 | gray;
+        }
+        palette[i * 4 + 0] = ((rgb >> 16) & 0xff) / 255.0f;
+        palette[i * 4 + 1] = ((rgb >> 8) & 0xff) / 255.0f;
+        palette[i * 4 + 2] = (rgb & 0xff) / 255.0f;
+        palette[i * 4 + 3] = 1.0f;
+    }
+}
+
+/* Uniforms of shade_src, identical for every program. */
+static void init_shade_uniforms(GLuint program, Font *font)
+{
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "text"), 0);
+    glUniform1i(glGetUniformLocation(program, "styles"), 1);
+    glUniform1i(glGetUniformLocation(program, "glyphs"), 2);
+    glUniform3f(glGetUniformLocation(program, "default_fg"), 1.0f, 1.0f, 1.0f);
+    glUniform3f(glGetUniformLocation(program, "default_bg"), 0.0f, 0.0f, 0.0f);
+    glUniform3f(glGetUniformLocation(program, "highlight"), 1.0f, 0.8f, 0.0f);
+    glUniform2f(glGetUniformLocation(program, "cell_size"), font->char_width, font->char_height);
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Palette"), 0);
+}
+
+static void render_grid_init(RenderContext *rc, Font *font)
+{
+    rc->grid_program = create_shader_program(grid_vertex_src, grid_fragment_src);
+    init_shade_uniforms(rc->grid_program, font);
+    glUniform1i(glGetUniformLocation(rc->grid_program, "grid"), 3);
+    rc->grid_reverse_location = glGetUniformLocation(rc->grid_program, "reverse");
+    rc->grid_row_offset_location = glGetUniformLocation(rc->grid_program, "row_offset");
+
+    glGenTextures(1, &rc->grid_texture);
+    glBindTexture(GL_TEXTURE_2D, rc->grid_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenVertexArrays(1, &rc->grid_vao);
+    rc->highlight_version = ~0u;
+}
+
+/* The framebuffer holds the screen in physical row order, like the grid
+ * texture, and is drawn with a row offset of 0. */
+static void render_retained_init(RenderContext *rc, Font *font)
+{
+    rc->retained_program = create_shader_program(vertex_src, retained_fragment_src);
+    init_shade_uniforms(rc->retained_program, font);
+    glUniform1i(glGetUniformLocation(rc->retained_program, "row_offset"), 0);
+    rc->retained_reverse_location = glGetUniformLocation(rc->retained_program, "reverse");
+
+    glGenTextures(1, &rc->retained_texture);
+    glBindTexture(GL_TEXTURE_2D, rc->retained_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenFramebuffers(1, &rc->retained_fbo);
+    rc->highlight_version = ~0u;
+}
+
+/* Waits until the GPU is done with the ring region about to be rewritten.
+ * With three regions this only blocks when the CPU is two frames ahead. */
+static void wait_region(RenderContext *rc, int region)
+{
+    GLsync fence = rc->fences[region];
+    if (fence == NULL)
+        return;
+    GLenum status;
+    do {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    } while (status == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    rc->fences[region] = NULL;
+}
+
+/* (Re)creates the instance buffer with room for `capacity` instances per
+ * ring region. Immutable storage cannot grow in place, so a larger buffer
+ * replaces it once the GPU is done with every region of the old one. */
+static void init_instance_buffer(RenderContext *rc, size_t capacity)
+{
+    for (int i = 0; i < INSTANCE_REGIONS; i++)
+        wait_region(rc, i);
+    if (rc->vbo)
+        glDeleteBuffers(1, &rc->vbo);
+    free(rc->instances);
+    rc->instances = NULL;
+    rc->mapped = NULL;
+    rc->count = 0;
+    rc->capacity = capacity;
+    rc->instances_size = rc->capacity * sizeof(Instance);
+
+    glGenBuffers(1, &rc->vbo);
+    glBindVertexArray(rc->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, rc->vbo);
+    if (GLAD_GL_VERSION_4_4) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                                 GL_MAP_COHERENT_BIT;
+        const GLsizeiptr size = INSTANCE_REGIONS * rc->instances_size;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        rc->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    }
+    if (rc->mapped == NULL) {
+        log_info("Persistent mapping unavailable, orphaning instance buffer.");
+        glBufferData(GL_ARRAY_BUFFER, rc->instances_size, NULL, GL_STREAM_DRAW);
+        rc->instances = malloc(rc->instances_size);
+        if (rc->instances == NULL)
+            fatal("Malloc failed.");
+    }
+    glVertexAttribIPointer(0, 2, GL_UNSIGNED_SHORT, sizeof(Instance), (void*) offsetof(Instance, column));
+    glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(Instance), (void*) offsetof(Instance, glyph));
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(Instance), (void*) offsetof(Instance, style));
+    for (GLuint i = 0; i < 3; i++) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+}
+
+static inline int grow(int capacity, int needed)
+{
+    return capacity * 2 > needed ? capacity * 2 : needed;
+}
+
+static void render_grid_resize(RenderContext *rc)
+{
+    glUseProgram(rc->grid_program);
+    glUniform1i(glGetUniformLocation(rc->grid_program, "columns"), rc->columns);
+    glUniform1i(glGetUniformLocation(rc->grid_program, "rows"), rc->rows);
+    glUniform1f(glGetUniformLocation(rc->grid_program, "height"), rc->height);
+    if (rc->columns <= rc->grid_texture_columns && rc->rows <= rc->grid_texture_rows)
+        return;
+    if (rc->columns > rc->grid_texture_columns)
+        rc->grid_texture_columns = grow(rc->grid_texture_columns, rc->columns);
+    if (rc->rows > rc->grid_texture_rows)
+        rc->grid_texture_rows = grow(rc->grid_texture_rows, rc->rows);
+    glBindTexture(GL_TEXTURE_2D, rc->grid_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, rc->grid_texture_columns,
+                 rc->grid_texture_rows, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+    free(rc->grid_row);
+    rc->grid_row = malloc(sizeof(uint32_t) * 2 * rc->grid_texture_columns);
+    if (rc->grid_row == NULL)
+        fatal("Malloc failed.");
+}
+
+/* Rows are drawn from the bottom of the framebuffer up, with the window's
+ * viewport, so the texture only needs to cover the grid. */
+static void render_retained_resize(RenderContext *rc)
+{
+    float projection[16];
+    ortho(projection, 0.0f, rc->width, 0.0f, rc->height, -100.0f, 100.0f);
+    glUseProgram(rc->retained_program);
+    glUniformMatrix4fv(glGetUniformLocation(rc->retained_program, "projection"),
+                       1, GL_FALSE, projection);
+    glUniform1i(glGetUniformLocation(rc->retained_program, "rows"), rc->rows);
+
+    const int width = rc->columns * rc->cell_width;
+    const int height = rc->rows * rc->cell_height;
+    if (width <= rc->retained_width && height <= rc->retained_height)
+        return;
+    if (width > rc->retained_width)
+        rc->retained_width = grow(rc->retained_width, width);
+    if (height > rc->retained_height)
+        rc->retained_height = grow(rc->retained_height, height);
+    glBindTexture(GL_TEXTURE_2D, rc->retained_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, rc->retained_width,
+                 rc->retained_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rc->retained_fbo);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           rc->retained_texture, 0);
+    if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fatal("Retained framebuffer incomplete.");
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+/* Follows a new framebuffer or grid size. Logical row 0 stays at the top
+ * of the window, whatever is left over below the last row is background.
+ * Storage sized by the grid only grows, geometrically, so a live resize
+ * reallocates a few times at most. The caller redraws everything. */
+static void render_resize(RenderContext *rc, int width, int height,
+                          int columns, int rows)
+{
+    rc->width = width;
+    rc->height = height;
+    rc->columns = columns;
+    rc->rows = rows;
+    glViewport(0, 0, width, height);
+    const float grid_height = rows * rc->cell_height;
+    ortho(rc->projection, 0.0f, width, grid_height - height, grid_height,
+          -100.0f, 100.0f);
+    glUseProgram(rc->program);
+    glUniformMatrix4fv(glGetUniformLocation(rc->program, "projection"), 1, GL_FALSE, rc->projection);
+    glUniform1i(glGetUniformLocation(rc->program, "rows"), rows);
+
+    rc->job.spans = realloc(rc->job.spans, sizeof(Damage) * rows);
+    if (rc->job.spans == NULL)
+        fatal("Realloc failed.");
+    const size_t count = (size_t) columns * rows;
+    rc->row_instances = realloc(rc->row_instances, sizeof(Instance) * count);
+    rc->row_counts = realloc(rc->row_counts, sizeof(uint16_t) * rows);
+    rc->row_stale = realloc(rc->row_stale, rows);
+    rc->commands = realloc(rc->commands, sizeof(DrawCommand) * rows);
+    if (rc->row_instances == NULL || rc->row_counts == NULL ||
+        rc->row_stale == NULL || rc->commands == NULL)
+        fatal("Realloc failed.");
+    if (count > rc->capacity)
+        init_instance_buffer(rc, rc->capacity * 2 > count ? rc->capacity * 2 : count);
+
+    if (rc->mode == RENDER_GRID)
+        render_grid_resize(rc);
+    else if (rc->mode == RENDER_RETAINED)
+        render_retained_resize(rc);
+    rc->highlight_version = ~0u;
+}
+
+/* Sizes are set by the first render_resize(). */
+static void render_init(RenderContext *rc, Font *font, RenderMode mode,
+                        ThreadPool *pool)
+{
+    rc->pool = pool;
+    rc->cell_width = font->char_width;
+    rc->cell_height = font->char_height;
+    rc->program = create_shader_program(vertex_src, fragment_src);
+    init_glyphs(rc, font);
+#ifdef GLTTY_HARFBUZZ
+    init_shaping(rc);
+#endif
+    init_shade_uniforms(rc->program, font);
+    rc->reverse_location = glGetUniformLocation(rc->program, "reverse");
+    rc->row_offset_location = glGetUniformLocation(rc->program, "row_offset");
+    rc->mode = mode;
+    if (mode == RENDER_GRID)
+        render_grid_init(rc, font);
+    else if (mode == RENDER_RETAINED)
+        render_retained_init(rc, font);
+
+    init_palette(rc->palette);
+    glGenBuffers(1, &rc->palette_ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, rc->palette_ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(rc->palette), rc->palette, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, rc->palette_ubo);
+
+    glGenBuffers(1, &rc->style_buffer);
+    glGenTextures(1, &rc->style_texture);
+    glBindBuffer(GL_TEXTURE_BUFFER, rc->style_buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, rc->style_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, rc->style_buffer);
+    rc->style_version = ~0u;
+
+    glGenVertexArrays(1, &rc->vao);
+    glGenBuffers(1, &rc->indirect);
+}
+
+static void bind_shade_textures(RenderContext *rc)
+{
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, rc->glyph_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, rc->style_texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, rc->texture);
+}
+
+/* The glyph of cell x of `row`. Glyphs past ASCII come from the cache,
+ * which resolve_glyphs() has filled for every cell about to be drawn; the
+ * spacer of a wide cell draws the right half of its glyph. */
+static inline uint32_t cell_glyph(const GlyphCache *glyphs, const Cell *row, int x)
+{
+    const uint32_t codepoint = cell_codepoint(row[x]);
+    if (codepoint > ASCII_BEGIN && codepoint <= ASCII_END)
+        return codepoint - ASCII_BEGIN + 1;
+    if (codepoint > ASCII_END)
+        return glyph_lookup(glyphs, codepoint);
+    if (x > 0 && (cell_flags(row[x]) & CELL_SPACER) &&
+        (cell_flags(row[x - 1]) & CELL_WIDE)) {
+        const uint32_t glyph = cell_glyph(glyphs, row, x - 1);
+        return glyph ? glyph | GLYPH_RIGHT_HALF : 0;
+    }
+    return 0;
+}
+
+/* The font variant of a style, which is also its atlas layer. */
+static inline int style_variant(const Style *style)
+{
+    return (style->attrs & ATTR_BOLD ? FONT_BOLD : 0) |
+           (style->attrs & ATTR_ITALIC ? FONT_ITALIC : 0);
+}
+
+/* The glyph cell x of `row` draws: the one shaping gave it, if any. */
+static inline uint32_t drawn_glyph(const GlyphCache *glyphs, const uint32_t *shaped,
+                                   const Cell *row, int x)
+{
+    if (shaped && shaped[x])
+        return shaped[x];
+    return cell_glyph(glyphs, row, x);
+}
+
+#ifdef GLTTY_HARFBUZZ
+/* Runs are shaped with the first face of their variant's chain, the one
+ * whose ligatures the user picked. */
+static hb_font_t *shaper(RenderContext *rc, int variant)
+{
+    if (rc->shapers[variant] == NULL)
+        rc->shapers[variant] = hb_ft_font_create_referenced(font_primary(rc->font, variant));
+    return rc->shapers[variant];
+}
+
+/* Shaped glyphs are keyed by glyph index and variant, past the codepoints
+ * so the cache only ever hashes them. */
+static uint32_t shaped_glyph(RenderContext *rc, int variant, FT_Face face,
+                             FT_UInt index, int columns)
+{
+    const uint32_t key = GLYPH_BMP + index * FONT_VARIANTS + variant;
+    uint32_t glyph = glyph_lookup(&rc->shaped_glyphs, key);
+    if (glyph == 0) {
+        glyph = glyph_new(rc, 0);
+        glyph_render(rc, glyph, variant, face, index, columns);
+        glyph_cache_insert(&rc->shaped_glyphs, key, glyph);
+    }
+    return glyph;
+}
+
+/* Shapes `length` cells of `text` into `glyphs`. Cells are drawn in logical
+ * order, so runs are shaped left to right whatever their script; joining
+ * forms apply all the same. A cell keeps its own glyph, 0, where shaping
+ * gave the face's usual glyph for it or where its cluster shaped to
+ * several glyphs, which a cell cannot draw. A cluster shaped to one glyph
+ * draws it across its cells, and so do neighbouring cells whose own glyph
+ * has no ink, the way ligature fonts pad their ligatures. */
+static void shape_run(RenderContext *rc, int variant, const uint32_t *text,
+                      int length, uint32_t *glyphs)
+{
+    hb_font_t *font = shaper(rc, variant);
+    FT_Face face = font_primary(rc->font, variant);
+    hb_buffer_t *buffer = rc->shape_buffer;
+    hb_buffer_clear_contents(buffer);
+    hb_buffer_add_codepoints(buffer, text, length, 0, length);
+    hb_buffer_guess_segment_properties(buffer);
+    hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+    hb_shape(font, buffer, NULL, 0);
+    unsigned int count;
+    const hb_glyph_info_t *info = hb_buffer_get_glyph_infos(buffer, &count);
+
+    /* Glyphs shaped per cluster, and the index of the last of them; a
+     * cluster runs from its first cell to the next cluster's. */
+    uint8_t clusters[SHAPE_RUN_MAX] = {0};
+    FT_UInt indices[SHAPE_RUN_MAX];
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned int cluster = info[i].cluster;
+        if (cluster < (unsigned int) length && clusters[cluster] < UINT8_MAX) {
+            clusters[cluster]++;
+            indices[cluster] = info[i].codepoint;
+        }
+    }
+
+    /* First pass: each cluster's glyph, 0 where the cell keeps its own,
+     * and the columns its ink covers relative to its first cell. */
+    int owner[SHAPE_RUN_MAX];
+    bool inked[SHAPE_RUN_MAX];
+    int ink_begin[SHAPE_RUN_MAX];
+    int ink_end[SHAPE_RUN_MAX];
+    const int cell = rc->cell_width * 64;
+    for (int x = 0, end; x < length; x = end) {
+        for (end = x + 1; end < length && clusters[end] == 0; end++)
+            owner[end] = x;
+        owner[x] = x;
+        hb_glyph_extents_t extents;
+        bool ink = true;
+        if (clusters[x] != 1 || indices[x] == 0 ||
+            (end == x + 1 && indices[x] == FT_Get_Char_Index(face, text[x]))) {
+            indices[x] = 0;
+        } else if (!hb_font_get_glyph_extents(font, indices[x], &extents) ||
+                   extents.width <= 0) {
+            indices[x] = 0;
+            ink = false;
+        } else {
+            /* Extents are in 26.6 pixels. */
+            const int left = extents.x_bearing;
+            const int right = extents.x_bearing + extents.width;
+            ink_begin[x] = left < 0 ? -((cell - 1 - left) / cell) : 0;
+            ink_end[x] = (right + cell - 1) / cell;
+            if (ink_end[x] < end - x)
+                ink_end[x] = end - x;
+        }
+        for (int i = x; i < end; i++) {
+            inked[i] = ink;
+            glyphs[i] = ink ? 0 : GLYPH_EMPTY;
+        }
+    }
+
+    /* Second pass: shaped glyphs are drawn over their own cells and any
+     * inkless ones their ink reaches. */
+    for (int x = 0; x < length; x++) {
+        if (owner[x] != x || indices[x] == 0)
+            continue;
+        const uint32_t glyph = shaped_glyph(rc, variant, face, indices[x],
+                                            ink_end[x] - ink_begin[x]);
+        for (int k = ink_begin[x]; k < ink_end[x]; k++) {
+            const int i = x + k;
+            if (i >= 0 && i < length && k >= -8 && k < 8 &&
+                (owner[i] == x || !inked[i]))
+                glyphs[i] = glyph | GLYPH_COLUMN(k);
+        }
+    }
+}
+
+static const uint32_t *shape_cached(RenderContext *rc, int variant,
+                                    const uint32_t *text, int length)
+{
+    uint32_t hash = 2166136261u ^ variant;
+    for (int i = 0; i < length; i++)
+        hash = (hash ^ text[i]) * 16777619u;
+    ShapedRun *run = &rc->shape_cache[hash & (SHAPE_CACHE_SIZE - 1)];
+    if (run->length == length && run->hash == hash && run->variant == variant &&
+        memcmp(run->text, text, sizeof(uint32_t) * length) == 0)
+        return run->glyphs;
+    run->hash = hash;
+    run->variant = variant;
+    run->length = length;
+    memcpy(run->text, text, sizeof(uint32_t) * length);
+    shape_run(rc, variant, text, length, run->glyphs);
+    return run->glyphs;
+}
+
+/* Cells are shaped unless they are blank, wide or hold more than one
+ * codepoint; clusters are not part of the snapshot. */
+static inline bool cell_shapeable(Cell cell)
+{
+    return cell_codepoint(cell) > ASCII_BEGIN && cell_flags(cell) == 0;
+}
+
+/* Reshapes the runs of physical row `y` its damage can have changed: the
+ * ones within a column of it, which covers runs it split or joined. Runs
+ * are also cut at multiples of SHAPE_RUN_MAX columns, so an edit never
+ * moves the chunks of a long run past its own. Cells whose glyph changed
+ * outside the damage are added to it. */
+static void shape_row(RenderContext *rc, Cells *cells, const StyleTable *styles,
+                      int y)
+{
+    Damage *d = &cells->damage[y];
+    if (d->begin >= d->end)
+        return;
+    const int columns = cells->columns;
+    const Cell *row = &cells->cells[(size_t) y * columns];
+    uint32_t *shaped = rc->shaped + (size_t) y * columns;
+    const int end = d->end < columns ? d->end + 1 : columns;
+    int changed_begin = d->begin;
+    int changed_end = d->end;
+    uint32_t text[SHAPE_RUN_MAX];
+
+    int x = d->begin > 0 ? d->begin - 1 : 0;
+    if (cell_shapeable(row[x])) {
+        const int variant = style_variant(&styles->styles[cell_style(row[x])]);
+        while (x % SHAPE_RUN_MAX && cell_shapeable(row[x - 1]) &&
+               style_variant(&styles->styles[cell_style(row[x - 1])]) == variant)
+            x--;
+    }
+    while (x < end) {
+        static const uint32_t unshaped[SHAPE_RUN_MAX];
+        const uint32_t *glyphs = unshaped;
+        int run = x + 1;
+        if (cell_shapeable(row[x])) {
+            const int variant = style_variant(&styles->styles[cell_style(row[x])]);
+            while (run < columns && run % SHAPE_RUN_MAX && cell_shapeable(row[run]) &&
+                   style_variant(&styles->styles[cell_style(row[run])]) == variant)
+                run++;
+            for (int i = x; i < run; i++)
+                text[i - x] = cell_codepoint(row[i]);
+            if (run - x > 1)
+                glyphs = shape_cached(rc, variant, text, run - x);
+        }
+        for (int i = x; i < run; i++) {
+            if (shaped[i] != glyphs[i - x]) {
+                shaped[i] = glyphs[i - x];
+                changed_begin = i < changed_begin ? i : changed_begin;
+                changed_end = i + 1 > changed_end ? i + 1 : changed_end;
+            }
+        }
+        x = run;
+    }
+    d->begin = changed_begin;
+    d->end = changed_end;
+}
+
+/* Shapes the damaged rows. The shaped glyphs of a new grid start out
+ * unset, so all of it is damaged. */
+static void shape_rows(RenderContext *rc, Cells *cells, const StyleTable *styles)
+{
+    if (rc->shaped_columns != cells->columns || rc->shaped_rows != cells->rows) {
+        free(rc->shaped);
+        rc->shaped = calloc(cells->count, sizeof(uint32_t));
+        if (rc->shaped == NULL)
+            fatal("Malloc failed.");
+        rc->shaped_columns = cells->columns;
+        rc->shaped_rows = cells->rows;
+        for (int y = 0; y < cells->rows; y++) {
+            cells->damage[y].begin = 0;
+            cells->damage[y].end = cells->columns;
+        }
+    }
+    for (int y = 0; y < cells->rows; y++)
+        shape_row(rc, cells, styles, y);
+}
+#endif
+
+/* Looks up the glyphs of codepoints past ASCII in the damaged spans, the
+ * only cells that can hold ones not seen before, and rasterizes the
+ * variants their styles ask for, so the instance workers only ever read
+ * the cache. Shaping, when built in, goes first and may widen the damage.
+ * Has to run before the damage is taken. */
+static void resolve_glyphs(RenderContext *rc, Cells *cells,
+                           const StyleTable *styles)
+{
+#ifdef GLTTY_HARFBUZZ
+    shape_rows(rc, cells, styles);
+#endif
+    for (int y = 0; y < cells->rows; y++) {
+        const Damage d = cells->damage[y];
+        const Cell *row = &cells->cells[(size_t) y * cells->columns];
+        const uint32_t *shaped = rc->shaped ? rc->shaped + (size_t) y * cells->columns : NULL;
+        uint16_t style_id = 0;
+        int variant = FONT_REGULAR;
+        for (int x = d.begin; x < d.end; x++) {
+            const uint32_t codepoint = cell_codepoint(row[x]);
+            if (codepoint <= ASCII_BEGIN || (shaped && shaped[x]))
+                continue;
+            if (cell_style(row[x]) != style_id) {
+                style_id = cell_style(row[x]);
+                variant = style_variant(&styles->styles[style_id]);
+            }
+            if (codepoint <= ASCII_END && variant == FONT_REGULAR)
+                continue;
+            uint32_t glyph = cell_glyph(&rc->glyph_cache, row, x);
+            if (glyph == 0)
+                glyph = glyph_resolve(rc, codepoint);
+            if (!(rc->glyph_variants[glyph] & (1u << variant)))
+                glyph_variant(rc, glyph, variant);
+        }
+    }
+    upload_glyphs(rc);
+}
+
+/* Reads and resets the damage of physical row `row`. */
+static inline Damage take_damage(Cells *cells, int row)
+{
+    const Damage d = cells->damage[row];
+    cells->damage[row].begin = UINT16_MAX;
+    cells->damage[row].end = 0;
+    return d;
+}
+
+/* Instances are written straight into the persistently mapped ring region
+ * of this frame and drawn with a base instance offset. Without a
+ * persistent mapping they are staged in rc->instances and uploaded into
+ * an orphaned buffer, so the driver never has to wait on the previous draw.
+ * The mapping is write-combined: fields are only ever written, never read
+ * back. */
+static Instance *begin_instances(RenderContext *rc)
+{
+    if (!rc->mapped)
+        return rc->instances;
+    rc->region = (rc->region + 1) % INSTANCE_REGIONS;
+    wait_region(rc, rc->region);
+    return rc->mapped + rc->region * rc->capacity;
+}
+
+/* `highlight` is the highlight row of the cell's logical row, or NULL. */
+static inline size_t emit_cell(Instance *out, const InstanceJob *job,
+                               const Cell *cells, const uint32_t *shaped,
+                               int row, int column,
+                               const unsigned char *highlight)
+{
+    const uint16_t style_id = cell_style(cells[column]);
+    const uint32_t glyph = drawn_glyph(job->glyphs, shaped, cells, column);
+    if (job->skip_blank && glyph == 0) {
+        const Style *style = &job->styles->styles[style_id];
+        if (style->bg == COLOR_DEFAULT &&
+            !(style->attrs & (ATTR_INVERSE | ATTR_UNDERLINE | ATTR_STRIKETHROUGH)))
+            return 0;
+    }
+    out->column = column;
+    out->row = row;
+    out->glyph = glyph;
+    out->style = style_id;
+    if (highlight && highlight[column])
+        out->style = style_id | INSTANCE_HIGHLIGHT;
+    return 1;
+}
+
+#ifdef __SSE2__
+/* Decodes four cells into glyph and style ids, mirroring cell_glyph() and
+ * cell_style() for ASCII. Returns a nonzero mask if any cell is past ASCII
+ * or a spacer, whose glyphs only cell_glyph() can tell. */
+static inline int decode_cells(const Cell *cells, const unsigned char *highlight,
+                               __m128i *glyph, __m128i *style)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *) cells);
+    const __m128i hi = _mm_loadu_si128((const __m128i *) (cells + 2));
+    /* Keeps the low half of each 64 bit lane. */
+    const __m128i words = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i styles = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(_mm_srli_epi64(lo, CELL_STYLE_SHIFT)),
+        _mm_castsi128_ps(_mm_srli_epi64(hi, CELL_STYLE_SHIFT)),
+        _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i codepoint = _mm_and_si128(words, _mm_set1_epi32(CELL_CODEPOINT_MASK));
+    const __m128i printable = _mm_and_si128(
+        _mm_cmpgt_epi32(codepoint, _mm_set1_epi32(ASCII_BEGIN)),
+        _mm_cmplt_epi32(codepoint, _mm_set1_epi32(ASCII_END + 1)));
+    *glyph = _mm_and_si128(printable,
+                           _mm_sub_epi32(codepoint, _mm_set1_epi32(ASCII_BEGIN - 1)));
+    const __m128i other = _mm_or_si128(
+        _mm_cmpgt_epi32(codepoint, _mm_set1_epi32(ASCII_END)),
+        _mm_cmpeq_epi32(codepoint, _mm_setzero_si128()));
+    *style = _mm_and_si128(styles, _mm_set1_epi32(0xffff));
+    if (highlight) {
+        int bytes;
+        memcpy(&bytes, highlight, sizeof(bytes));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i marks = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        marks = _mm_unpacklo_epi16(marks, zero);
+        *style = _mm_or_si128(*style, _mm_andnot_si128(_mm_cmpeq_epi32(marks, zero),
+                                                       _mm_set1_epi32(INSTANCE_HIGHLIGHT)));
+    }
+    return _mm_movemask_epi8(other);
+}
+
+/* Interleaves four (column | row << 16, glyph, style) triples into four
+ * 12 byte instances with three full width stores, which also suits the
+ * write-combined mapping better than field by field writes. */
+static inline void store_instances(Instance *out, __m128i cell, __m128i glyph,
+                                   __m128i style)
+{
+    const __m128 c = _mm_castsi128_ps(cell);
+    const __m128 g = _mm_castsi128_ps(glyph);
+    const __m128 s = _mm_castsi128_ps(style);
+    const __m128 cg_lo = _mm_unpacklo_ps(c, g);
+    const __m128 cg_hi = _mm_unpackhi_ps(c, g);
+    const __m128 sc_lo = _mm_unpacklo_ps(s, c);
+    const __m128 sc_hi = _mm_unpackhi_ps(s, c);
+    const __m128 gs_lo = _mm_unpacklo_ps(g, s);
+    const __m128 gs_hi = _mm_unpackhi_ps(g, s);
+    float *dst = (float *) out;
+    _mm_storeu_ps(dst, _mm_shuffle_ps(cg_lo, sc_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+    _mm_storeu_ps(dst + 4, _mm_shuffle_ps(gs_lo, cg_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    _mm_storeu_ps(dst + 8, _mm_shuffle_ps(sc_hi, gs_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+}
+#endif
+
+/* Emits the cells of `span` in physical row `row`. With SSE2 four cells
+ * are decoded and stored per step; a group holding a cell past ASCII or a
+ * shaped one, or with skip_blank a glyphless one, goes through
+ * emit_cell(). */
+static size_t emit_span(Instance *out, const InstanceJob *job, const Cell *cells,
+                        const uint32_t *shaped, int row, Damage span,
+                        const unsigned char *highlight)
+{
+    size_t count = 0;
+    int x = span.begin;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    for (; x + 4 <= span.end; x += 4) {
+        __m128i glyph, style;
+        if (decode_cells(cells + x, highlight ? highlight + x : NULL, &glyph, &style) ||
+            (shaped && (shaped[x] | shaped[x + 1] | shaped[x + 2] | shaped[x + 3])) ||
+            (job->skip_blank && _mm_movemask_epi8(_mm_cmpeq_epi32(glyph, zero)))) {
+            for (int i = x; i < x + 4; i++)
+                count += emit_cell(out + count, job, cells, shaped, row, i, highlight);
+            continue;
+        }
+        const __m128i cell = _mm_add_epi32(_mm_set1_epi32(row << 16 | x), lanes);
+        store_instances(out + count, cell, glyph, style);
+        count += 4;
+    }
+#endif
+    for (; x < span.end; x++)
+        count += emit_cell(out + count, job, cells, shaped, row, x, highlight);
+    return count;
+}
+
+static void instance_band_task(void *arg, size_t band, int worker)
+{
+    (void) worker;
+    InstanceJob *job = arg;
+    const Cells *cells = job->cells;
+    const int first = band * job->band_rows;
+    const int last = first + job->band_rows < cells->rows ?
+                     first + job->band_rows : cells->rows;
+    Instance *out = job->out + job->offsets[band];
+    size_t count = 0;
+    for (int y = first; y < last; y++) {
+        const Damage span = job->spans[y];
+        if (span.begin >= span.end)
+            continue;
+        const int logical = (y - cells->top + cells->rows) % cells->rows;
+        const unsigned char *highlight = job->highlight ?
+            job->highlight + logical * cells->columns : NULL;
+        const uint32_t *shaped = job->shaped ?
+            job->shaped + (size_t) y * cells->columns : NULL;
+        if (job->row_counts) {
+            job->row_counts[y] = emit_span(job->out + (size_t) y * cells->columns, job,
+                                           &cells->cells[y * cells->columns],
+                                           shaped, y, span, highlight);
+            continue;
+        }
+        count += emit_span(out + count, job, &cells->cells[y * cells->columns],
+                           shaped, y, span, highlight);
+    }
+    job->counts[band] = count;
+}
+
+/* Splits rc->job into row bands for `total` cells and runs it. */
+static void run_instance_job(RenderContext *rc, Cells *cells,
+                             const StyleTable *styles,
+                             const unsigned char *highlight, size_t total)
+{
+    InstanceJob *job = &rc->job;
+    int bands = 1;
+    if (total >= INSTANCE_PARALLEL_MIN && rc->pool->count > 1)
+        bands = (rc->pool->count + 1) * 2;
+    if (bands > INSTANCE_BANDS_MAX)
+        bands = INSTANCE_BANDS_MAX;
+    job->band_rows = (cells->rows + bands - 1) / bands;
+    job->bands = (cells->rows + job->band_rows - 1) / job->band_rows;
+
+    size_t offset = 0;
+    for (int y = 0; y < cells->rows; y++) {
+        if (y % job->band_rows == 0)
+            job->offsets[y / job->band_rows] = offset;
+        if (job->spans[y].begin < job->spans[y].end)
+            offset += job->spans[y].end - job->spans[y].begin;
+    }
+
+    job->cells = cells;
+    job->styles = styles;
+    job->glyphs = &rc->glyph_cache;
+    job->shaped = rc->shaped;
+    job->highlight = highlight;
+    if (job->bands == 1) {
+        instance_band_task(job, 0, rc->pool->count);
+    } else {
+        pool_submit(rc->pool, &rc->batch, instance_band_task, job, job->bands);
+        pool_wait(rc->pool, &rc->batch);
+    }
+}
+
+/* Builds instances for the `total` cells of rc->job.spans into this
+ * frame's region. Large jobs are split into row bands built by the pool,
+ * each band at the offset of its first cell, so workers write straight
+ * into the mapping without coordinating; small ones, the common case of a
+ * few damaged rows, take a single band on the calling thread. */
+static void build_instances(RenderContext *rc, Cells *cells,
+                            const StyleTable *styles,
+                            const unsigned char *highlight, size_t total)
+{
+    InstanceJob *job = &rc->job;
+    job->row_counts = NULL;
+    job->out = begin_instances(rc);
+    run_instance_job(rc, cells, styles, highlight, total);
+
+    rc->count = 0;
+    for (int i = 0; i < job->bands; i++)
+        rc->count += job->counts[i];
+    if (!rc->mapped) {
+        /* Staging memory is cached, so the bands are packed before the
+         * upload and drawn as one. */
+        size_t count = job->counts[0];
+        for (int i = 1; i < job->bands; i++) {
+            memmove(job->out + count, job->out + job->offsets[i],
+                    job->counts[i] * sizeof(Instance));
+            count += job->counts[i];
+        }
+        job->offsets[0] = 0;
+        job->counts[0] = count;
+        job->bands = 1;
+        glBindBuffer(GL_ARRAY_BUFFER, rc->vbo);
+        glBufferData(GL_ARRAY_BUFFER, rc->instances_size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(Instance), job->out);
+    }
+}
+
+/* Draws the instances of the current region with the bound program, one
+ * instanced draw per band. */
+static void draw_instances(RenderContext *rc)
+{
+    const InstanceJob *job = &rc->job;
+    glBindVertexArray(rc->vao);
+    bind_shade_textures(rc);
+    if (rc->mapped) {
+        for (int i = 0; i < job->bands; i++) {
+            if (job->counts[i] == 0)
+                continue;
+            glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, job->counts[i],
+                                              rc->region * rc->capacity + job->offsets[i]);
+        }
+        if (rc->fences[rc->region])
+            glDeleteSync(rc->fences[rc->region]);
+        rc->fences[rc->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    } else {
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, rc->count);
+    }
+}
+
+/* Copies the row slots that changed since this frame's region was last
+ * drawn into it and points one indirect draw at each slot, so a scroll
+ * copies only the new row. Without a mapping every slot is uploaded into
+ * an orphaned buffer instead, which keeps the driver from waiting on the
+ * previous draw. */
+static void upload_row_instances(RenderContext *rc, Cells *cells)
+{
+    Instance *out = begin_instances(rc);
+    const size_t base = rc->mapped ? rc->region * rc->capacity : 0;
+    const uint8_t region = 1u << rc->region;
+    if (!rc->mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, rc->vbo);
+        glBufferData(GL_ARRAY_BUFFER, rc->instances_size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, cells->count * sizeof(Instance),
+                        rc->row_instances);
+    }
+    for (int y = 0; y < cells->rows; y++) {
+        const size_t slot = (size_t) y * cells->columns;
+        if (rc->mapped && (rc->row_stale[y] & region)) {
+            rc->row_stale[y] &= ~region;
+            memcpy(out + slot, rc->row_instances + slot,
+                   rc->row_counts[y] * sizeof(Instance));
+        }
+        rc->commands[y].count = 4;
+        rc->commands[y].instance_count = rc->row_counts[y];
+        rc->commands[y].first = 0;
+        rc->commands[y].base_instance = base + slot;
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, rc->indirect);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, cells->rows * sizeof(DrawCommand),
+                 rc->commands, GL_STREAM_DRAW);
+}
+
+/* Only damaged rows are emitted again, each whole into its slot since
+ * blank cells are skipped, and every row after a resize or a highlight
+ * change. Nothing damaged: the last region is drawn again. */
+static void render_instances(RenderContext *rc, Terminal *t, Cells *cells,
+                             const unsigned char *highlight,
+                             unsigned highlight_version)
+{
+    const bool all = rc->highlight_version != highlight_version;
+    rc->highlight_version = highlight_version;
+
+    size_t total = 0;
+    for (int y = 0; y < cells->rows; y++) {
+        const Damage d = take_damage(cells, y);
+        rc->job.spans[y].begin = 0;
+        rc->job.spans[y].end = 0;
+        if (all || d.begin < d.end) {
+            rc->job.spans[y].end = cells->columns;
+            rc->row_stale[y] = (1u << INSTANCE_REGIONS) - 1;
+            total += cells->columns;
+        }
+    }
+    if (total) {
+        rc->job.row_counts = rc->row_counts;
+        rc->job.out = rc->row_instances;
+        rc->job.skip_blank = true;
+        run_instance_job(rc, cells, &t->styles, highlight, total);
+        upload_row_instances(rc, cells);
+    }
+
+    glUseProgram(rc->program);
+    glUniform1i(rc->reverse_location, t->reverse);
+    glUniform1i(rc->row_offset_location, cells->top);
+    glBindVertexArray(rc->vao);
+    bind_shade_textures(rc);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, rc->indirect);
+    glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP, NULL, cells->rows, 0);
+    if (rc->mapped) {
+        if (rc->fences[rc->region])
+            glDeleteSync(rc->fences[rc->region]);
+        rc->fences[rc->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+/* Texture rows are physical rows, so a scroll uploads the one new row and
+ * moves `row_offset`. Only the damaged span of each row is uploaded (every
+ * row when the search highlight changed); the frame itself is one triangle
+ * whatever the content. */
+static void render_grid(RenderContext *rc, Terminal *t, Cells *cells,
+                        const unsigned char *highlight,
+                        unsigned highlight_version)
+{
+    const bool all = rc->highlight_version != highlight_version;
+    rc->highlight_version = highlight_version;
+
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, rc->grid_texture);
+    for (int y = 0; y < t->rows; y++) {
+        Damage d = take_damage(cells, y);
+        if (all) {
+            d.begin = 0;
+            d.end = t->columns;
+        }
+        if (d.begin >= d.end)
+            continue;
+        const Cell *row = &cells->cells[y * t->columns];
+        const uint32_t *shaped = rc->shaped ? rc->shaped + (size_t) y * t->columns : NULL;
+        const int logical = (y - cells->top + t->rows) % t->rows;
+        for (int x = d.begin; x < d.end; x++) {
+            uint32_t style = cell_style(row[x]);
+            if (highlight && highlight[logical * t->columns + x])
+                style |= INSTANCE_HIGHLIGHT;
+            rc->grid_row[2 * x] = drawn_glyph(&rc->glyph_cache, shaped, row, x);
+            rc->grid_row[2 * x + 1] = style;
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, d.begin, y, d.end - d.begin, 1,
+                        GL_RG_INTEGER, GL_UNSIGNED_INT, rc->grid_row + 2 * d.begin);
+    }
+
+    glUseProgram(rc->grid_program);
+    glUniform1i(rc->grid_reverse_location, t->reverse);
+    glUniform1i(rc->grid_row_offset_location, cells->top);
+    bind_shade_textures(rc);
+    glBindVertexArray(rc->grid_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+/* Only damaged cells are drawn into the retained framebuffer, one opaque
+ * instance each, blank cells included, so the GPU work of a frame follows
+ * the changed area. Each instance covers exactly its cell, which makes a
+ * scissor unnecessary. The framebuffer is in physical row order: a scroll
+ * redraws one row and the present, two blits, rotates it by `top`. */
+static void render_retained(RenderContext *rc, Terminal *t, Cells *cells,
+                            const unsigned char *highlight,
+                            unsigned highlight_version)
+{
+    const bool all = rc->highlight_version != highlight_version ||
+                     rc->retained_reverse != t->reverse;
+    rc->highlight_version = highlight_version;
+    rc->retained_reverse = t->reverse;
+
+    size_t count = 0;
+    for (int y = 0; y < t->rows; y++) {
+        Damage d = take_damage(cells, y);
+        if (all) {
+            d.begin = 0;
+            d.end = t->columns;
+        }
+        if (d.begin < d.end)
+            count += d.end - d.begin;
+        rc->job.spans[y] = d;
+    }
+
+    GLint target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+    if (count) {
+        rc->job.skip_blank = false;
+        build_instances(rc, cells, &t->styles, highlight, count);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rc->retained_fbo);
+        glDisable(GL_BLEND);
+        glUseProgram(rc->retained_program);
+        glUniform1i(rc->retained_reverse_location, t->reverse);
+        draw_instances(rc);
+        glEnable(GL_BLEND);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+    }
+
+    /* Physical rows [top, rows) are the upper part of the screen, which
+     * sits at the top of the window. */
+    const int width = t->columns * rc->cell_width;
+    const int height = t->rows * rc->cell_height;
+    const int split = (t->rows - cells->top) * rc->cell_height;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, rc->retained_fbo);
+    glBlitFramebuffer(0, 0, width, split,
+                      0, rc->height - split, width, rc->height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    if (cells->top)
+        glBlitFramebuffer(0, split, width, height,
+                          0, rc->height - height, width, rc->height - split,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target);
+}
+
+static void render(RenderContext *rc, Terminal *t, Cells *cells,
+                   const unsigned char *highlight, unsigned highlight_version)
+{
+    const StyleTable *styles = &t->styles;
+    if (rc->style_version != styles->version) {
+        glBindBuffer(GL_TEXTURE_BUFFER, rc->style_buffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(Style) * styles->capacity,
+                     styles->styles, GL_DYNAMIC_DRAW);
+        rc->style_version = styles->version;
+    }
+    resolve_glyphs(rc, cells, styles);
+    switch (rc->mode) {
+    case RENDER_GRID:
+        render_grid(rc, t, cells, highlight, highlight_version);
+        break;
+    case RENDER_RETAINED:
+        render_retained(rc, t, cells, highlight, highlight_version);
+        break;
+    default:
+        render_instances(rc, t, cells, highlight, highlight_version);
+        break;
+    }
+}
+
+static inline uint32_t trigram(const char *s)
+{
+    return ((uint32_t) (unsigned char) s[0] << 16) |
+           ((uint32_t) (unsigned char) s[1] << 8) |
+           (uint32_t) (unsigned char) s[2];
+}
+
+/* Two bit positions per trigram from multiplicative hashes; 16 bits each
+ * for a SCROLLBACK_BLOOM_BITS of 65536. */
+static inline void bloom_bits(uint32_t t, uint32_t *a, uint32_t *b)
+{
+    *a = (t * 0x9e3779b1u) >> 16;
+    *b = (t * 0x85ebca6bu) >> 16;
+}
+
+static bool bloom_may_contain(const uint8_t *bloom, const uint32_t *trigrams,
+                              size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t a, b;
+        bloom_bits(trigrams[i], &a, &b);
+        if (!(bloom[a >> 3] & (1u << (a & 7))) ||
+            !(bloom[b >> 3] & (1u << (b & 7))))
+            return false;
+    }
+    return true;
+}
+
+static void index_block_task(void *arg, size_t task, int worker)
+{
+    (void) task;
+    (void) worker;
+    ScrollbackBlock *block = arg;
+    uint8_t *bloom = calloc(SCROLLBACK_BLOOM_BITS / 8, 1);
+    if (bloom == NULL)
+        return;
+    for (size_t i = 0; i + 3 <= block->size; i++) {
+        uint32_t a, b;
+        bloom_bits(trigram(block->data + i), &a, &b);
+        bloom[a >> 3] |= 1u << (a & 7);
+        bloom[b >> 3] |= 1u << (b & 7);
+    }
+    block->bloom = bloom;
+}
+
+static void init_scrollback(Scrollback *sb, ThreadPool *pool, int columns)
+{
+    memset(sb, 0, sizeof(Scrollback));
+    sb->pool = pool;
+    sb->columns = columns;
+    sb->pending_capacity = 256;
+    sb->pending = malloc(sb->pending_capacity);
+    if (sb->pending == NULL)
+        fatal("Malloc failed.");
+    sb->pending[0] = '\0';
+}
+
+static ScrollbackBlock *scrollback_new_block(Scrollback *sb, size_t min_size)
+{
+    size_t capacity = SCROLLBACK_BLOCK_SIZE;
+    if (capacity < min_size)
+        capacity = min_size;
+    ScrollbackBlock *block = malloc(sizeof(ScrollbackBlock) + capacity + 1);
+    if (block == NULL)
+        fatal("Malloc failed.");
+    block->first_line = sb->lines;
+    block->lines = 0;
+    block->size = 0;
+    block->capacity = capacity;
+    block->bloom = NULL;
+    block->data[0] = '\0';
+
+    if (sb->count) {
+        ScrollbackBlock *sealed = sb->blocks[sb->count - 1];
+        pool_submit(sb->pool, &sealed->index_batch, index_block_task, sealed, 1);
+    }
+    if (sb->count == sb->capacity) {
+        sb->capacity = sb->capacity ? sb->capacity * 2 : 64;
+        sb->blocks = realloc(sb->blocks, sizeof(ScrollbackBlock *) * sb->capacity);
+        sb->block_rows = realloc(sb->block_rows, sizeof(size_t) * sb->capacity);
+        if (sb->blocks == NULL || sb->block_rows == NULL)
+            fatal("Realloc failed.");
+    }
+    sb->block_rows[sb->count] = 0;
+    sb->blocks[sb->count++] = block;
+    return block;
+}
+
+/* History lines are laid out as the screen lays out output: grapheme
+ * clusters take the width of their first codepoint unless they widen, a
+ * wide cluster that does not fit at the end of a row starts the next one,
+ * and zero width codepoints that start no cluster take no cell. Rows
+ * [first, first + count) go into `out` as default style cells when it is
+ * not NULL, and the byte offset of each written cell's cluster into
+ * `offsets` when that is not NULL. Returns the number of rows. */
+static size_t line_layout(const char *text, size_t length, int columns,
+                          size_t first, int count, Cell *out, uint32_t *offsets)
+{
+    Segmenter segmenter = {GRAPHEME_CONTROL, false, false};
+    size_t row = 0;
+    int x = 0;
+    int width = 0;
+    uint32_t start = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < length && !(out && row >= first + count);) {
+        uint32_t codepoint;
+        const size_t begin = i;
+        i += utf8_decode(text + i, text + length, &codepoint);
+        const int property = grapheme_property(codepoint);
+        const bool continues = grapheme_continues(&segmenter, property);
+        segmenter_push(&segmenter, property, continues);
+        if (continues) {
+            if (width == 1 && x < columns && cluster_widens(start, codepoint)) {
+                if (out && row >= first) {
+                    Cell *cell = out + (row - first) * columns + x - 1;
+                    cell[0] = cell_make(start, STYLE_DEFAULT, CELL_WIDE);
+                    cell[1] = cell_make(0, STYLE_DEFAULT, CELL_SPACER);
+                    if (offsets)
+                        offsets[(row - first) * columns + x] = offset;
+                }
+                width = 2;
+                x++;
+            }
+            continue;
+        }
+        width = codepoint_width(codepoint);
+        if (width == 0) {
+            segmenter.last = GRAPHEME_CONTROL;
+            continue;
+        }
+        if (width > columns)
+            width = 1;
+        if (x + width > columns) {
+            row++;
+            x = 0;
+        }
+        if (out && row >= first && row < first + count) {
+            const size_t at = (row - first) * columns + x;
+            out[at] = cell_make(codepoint, STYLE_DEFAULT, width == 2 ? CELL_WIDE : 0);
+            if (width == 2)
+                out[at + 1] = cell_make(0, STYLE_DEFAULT, CELL_SPACER);
+            for (int k = 0; offsets && k < width; k++)
+                offsets[at + k] = begin;
+        }
+        start = codepoint;
+        offset = begin;
+        x += width;
+    }
+    return row + 1;
+}
+
+/* ASCII lines skip decoding. */
+static size_t line_rows(const char *text, size_t length, int columns)
+{
+    if (text_is_ascii(text, length))
+        return length ? (length + columns - 1) / columns : 1;
+    return line_layout(text, length, columns, 0, 0, NULL, NULL);
+}
+
+/* Writes rows [first, first + count) of a line laid out by line_rows()
+ * into `out` as default style cells. Clusters keep only their first
+ * codepoint. */
+static void line_cells(const char *text, size_t length, int columns,
+                       size_t first, int count, Cell *out)
+{
+    if (text_is_ascii(text, length)) {
+        for (int y = 0; y < count; y++)
+            for (size_t x = (first + y) * columns; x < length && x < (first + y + 1) * columns; x++)
+                out[(size_t) y * columns + x - (first + y) * columns] =
+                    cell_make((unsigned char) text[x], STYLE_DEFAULT, 0);
+        return;
+    }
+    line_layout(text, length, columns, first, count, out, NULL);
+}
+
+/* Appends one screen row. Soft-wrapped rows are joined with the next row so
+ * that history holds logical lines. */
+static void scrollback_push(Scrollback *sb, const char *text, size_t size,
+                            bool wrapped)
+{
+    if (sb->pending_size + size + 1 > sb->pending_capacity) {
+        while (sb->pending_size + size + 1 > sb->pending_capacity)
+            sb->pending_capacity *= 2;
+        sb->pending = realloc(sb->pending, sb->pending_capacity);
+        if (sb->pending == NULL)
+            fatal("Realloc failed.");
+    }
+    memcpy(sb->pending + sb->pending_size, text, size);
+    sb->pending_size += size;
+    sb->pending[sb->pending_size] = '\0';
+    if (wrapped)
+        return;
+
+    const size_t line_size = sb->pending_size + 1;
+    ScrollbackBlock *block = sb->count ? sb->blocks[sb->count - 1] : NULL;
+    if (!block || block->size + line_size > block->capacity)
+        block = scrollback_new_block(sb, line_size);
+    memcpy(block->data + block->size, sb->pending, sb->pending_size);
+    block->size += line_size;
+    block->data[block->size - 1] = '\n';
+    block->data[block->size] = '\0';
+    block->lines++;
+    sb->lines++;
+    if (sb->block_rows[sb->count - 1] != SCROLLBACK_ROWS_UNKNOWN)
+        sb->block_rows[sb->count - 1] += line_rows(sb->pending, sb->pending_size,
+                                                   sb->columns);
+    sb->pending_size = 0;
+    sb->pending[0] = '\0';
+}
+
+/* With SSE2 two cells go out per 16 byte store, eight cells a step. */
+static void fill_cells(Cell *cells, Cell value, size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i v = _mm_set1_epi64x((long long) value);
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i *) (cells + i), v);
+        _mm_storeu_si128((__m128i *) (cells + i + 2), v);
+        _mm_storeu_si128((__m128i *) (cells + i + 4), v);
+        _mm_storeu_si128((__m128i *) (cells + i + 6), v);
+    }
+#endif
+    for (; i < count; i++)
+        cells[i] = value;
+}
+
+static size_t count_block_rows(const ScrollbackBlock *block, int columns)
+{
+    size_t rows = 0;
+    const char *p = block->data;
+    const char *end = block->data + block->size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        rows += line_rows(p, nl - p, columns);
+        p = nl + 1;
+    }
+    return rows;
+}
+
+static void reflow_block_task(void *arg, size_t task, int worker)
+{
+    (void) worker;
+    ReflowJob *job = arg;
+    job->rows[task] = count_block_rows(job->blocks[task], job->columns);
+}
+
+static void reflow_job_free(ReflowJob *job)
+{
+    free(job->blocks);
+    free(job->rows);
+    free(job);
+}
+
+/* Takes the counts of a finished reflow job and frees retired ones. */
+static void scrollback_reap(Scrollback *sb)
+{
+    ReflowJob *job = sb->reflow;
+    if (job && pool_done(sb->pool, &job->batch)) {
+        for (size_t i = 0; i < job->count; i++)
+            if (sb->block_rows[i] == SCROLLBACK_ROWS_UNKNOWN)
+                sb->block_rows[i] = job->rows[i];
+        reflow_job_free(job);
+        sb->reflow = NULL;
+    }
+    ReflowJob **link = &sb->retired;
+    while (*link) {
+        job = *link;
+        if (pool_done(sb->pool, &job->batch)) {
+            *link = job->next;
+            reflow_job_free(job);
+        } else {
+            link = &job->next;
+        }
+    }
+}
+
+/* Rewraps history at `columns`. Only the open block, which is still being
+ * appended to, is counted right away. */
+static void scrollback_set_columns(Scrollback *sb, int columns)
+{
+    if (sb->columns == columns)
+        return;
+    sb->columns = columns;
+    if (sb->reflow) {
+        sb->reflow->next = sb->retired;
+        sb->retired = sb->reflow;
+        sb->reflow = NULL;
+    }
+    for (size_t i = 0; i < sb->count; i++)
+        sb->block_rows[i] = SCROLLBACK_ROWS_UNKNOWN;
+    if (sb->count)
+        sb->block_rows[sb->count - 1] = count_block_rows(sb->blocks[sb->count - 1],
+                                                          columns);
+}
+
+/* Counts the rows of every sealed block not yet counted at the current
+ * width on the pool. Blocks hold whole lines, so each is independent. */
+static void scrollback_reflow(Scrollback *sb)
+{
+    const size_t sealed = sb->count ? sb->count - 1 : 0;
+    if (sb->reflow || sealed == 0)
+        return;
+    size_t count = 0;
+    for (size_t i = 0; i < sealed; i++)
+        if (sb->block_rows[i] == SCROLLBACK_ROWS_UNKNOWN)
+            count = i + 1;
+    if (count == 0)
+        return;
+
+    ReflowJob *job = calloc(1, sizeof(ReflowJob));
+    if (job == NULL)
+        fatal("Malloc failed.");
+    job->columns = sb->columns;
+    job->count = count;
+    job->blocks = malloc(sizeof(ScrollbackBlock *) * count);
+    job->rows = malloc(sizeof(size_t) * count);
+    if (job->blocks == NULL || job->rows == NULL)
+        fatal("Malloc failed.");
+    memcpy(job->blocks, sb->blocks, sizeof(ScrollbackBlock *) * count);
+    sb->reflow = job;
+    pool_submit(sb->pool, &job->batch, reflow_block_task, job, count);
+}
+
+static size_t scrollback_block_rows(Scrollback *sb, size_t i)
+{
+    if (sb->block_rows[i] == SCROLLBACK_ROWS_UNKNOWN) {
+        scrollback_reap(sb);
+        if (sb->block_rows[i] == SCROLLBACK_ROWS_UNKNOWN)
+            sb->block_rows[i] = count_block_rows(sb->blocks[i], sb->columns);
+    }
+    return sb->block_rows[i];
+}
+
+/* Rows of the line still being joined, shown as a line of its own. */
+static inline size_t pending_rows(const Scrollback *sb)
+{
+    return sb->pending_size ? line_rows(sb->pending, sb->pending_size, sb->columns) : 0;
+}
+
+/* Returns the number of history rows, up to `limit`. Only blocks within
+ * that depth are counted. */
+static size_t scrollback_depth(Scrollback *sb, size_t limit)
+{
+    size_t depth = pending_rows(sb);
+    for (size_t i = sb->count; i-- > 0 && depth < limit;)
+        depth += scrollback_block_rows(sb, i);
+    return depth < limit ? depth : limit;
+}
+
+/* Finds the history row `distance` rows above the screen, at most
+ * scrollback_depth(): returns its row within block `*block`, where index
+ * sb->count stands for the pending line. */
+static size_t scrollback_seek(Scrollback *sb, size_t distance, size_t *block)
+{
+    *block = sb->count;
+    const size_t pending = pending_rows(sb);
+    if (distance <= pending)
+        return pending - distance;
+    distance -= pending;
+    size_t rows = 0;
+    while (*block > 0) {
+        rows = scrollback_block_rows(sb, --*block);
+        if (distance <= rows)
+            break;
+        distance -= rows;
+    }
+    return rows - distance;
+}
+
+/* Writes `count` rows of history, from `distance` rows above the screen
+ * down, as default style cells. `distance` is at most scrollback_depth(). */
+static void scrollback_rows(Scrollback *sb, size_t distance, int count, Cell *out)
+{
+    const int columns = sb->columns;
+    fill_cells(out, CELL_BLANK, (size_t) count * columns);
+    size_t block;
+    size_t row = scrollback_seek(sb, distance, &block);
+
+    int y = 0;
+    for (; y < count && block <= sb->count; block++) {
+        const char *p = block < sb->count ? sb->blocks[block]->data : sb->pending;
+        const char *end = p + (block < sb->count ? sb->blocks[block]->size
+                                                 : sb->pending_size);
+        while (y < count && p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (nl == NULL)
+                nl = end;
+            const size_t length = nl - p;
+            const size_t rows = line_rows(p, length, columns);
+            if (row >= rows) {
+                row -= rows;
+            } else {
+                const int n = rows - row < (size_t) (count - y) ? (int) (rows - row)
+                                                                : count - y;
+                line_cells(p, length, columns, row, n, out + (size_t) y * columns);
+                y += n;
+                row = 0;
+            }
+            p = nl + 1;
+        }
+    }
+}
+
+/* A history line on screen: rows [row, row + count) of it are at screen
+ * row `y`. */
+typedef struct {
+    size_t line;
+    const char *text;
+    size_t length;
+    size_t row;
+    int y;
+    int count;
+} VisibleLine;
+
+static int visible_line_compare(const void *key, const void *item)
+{
+    const size_t line = *(const size_t *) key;
+    const VisibleLine *v = item;
+    return line < v->line ? -1 : line > v->line;
+}
+
+/* Marks the cells of `matches` in the `count` rows of history that
+ * scrollback_rows() writes for `distance`, in `out`, a byte per cell. The
+ * pending line is never searched. */
+static void scrollback_highlight(Scrollback *sb, size_t distance, int count,
+                                 const SearchMatches *matches, unsigned char *out)
+{
+    const int columns = sb->columns;
+    memset(out, 0, (size_t) count * columns);
+    VisibleLine *visible = malloc(sizeof(VisibleLine) * count);
+    Cell *cells = malloc(sizeof(Cell) * columns * count);
+    uint32_t *offsets = malloc(sizeof(uint32_t) * columns * count);
+    if (visible == NULL || cells == NULL || offsets == NULL)
+        fatal("Malloc failed.");
+    size_t block;
+    size_t row = scrollback_seek(sb, distance, &block);
+    int lines = 0;
+    for (int y = 0; y < count && block < sb->count; block++) {
+        const ScrollbackBlock *b = sb->blocks[block];
+        const char *p = b->data;
+        const char *end = b->data + b->size;
+        for (size_t line = b->first_line; y < count && p < end; line++) {
+            const char *nl = memchr(p, '\n', end - p);
+            const size_t length = nl - p;
+            const size_t rows = line_rows(p, length, columns);
+            if (row >= rows) {
+                row -= rows;
+            } else {
+                const int n = rows - row < (size_t) (count - y) ? (int) (rows - row)
+                                                                : count - y;
+                visible[lines++] = (VisibleLine) {line, p, length, row, y, n};
+                y += n;
+                row = 0;
+            }
+            p = nl + 1;
+        }
+    }
+
+    for (size_t i = 0; lines && i < matches->count; i++) {
+        const SearchMatch *m = &matches->items[i];
+        const VisibleLine *v = bsearch(&m->line, visible, lines, sizeof(VisibleLine),
+                                       visible_line_compare);
+        if (v == NULL)
+            continue;
+        const size_t cells_count = (size_t) v->count * columns;
+        unsigned char *mark = out + (size_t) v->y * columns;
+        if (text_is_ascii(v->text, v->length)) {
+            const size_t base = v->row * columns;
+            for (size_t k = m->column; k < m->column + m->length; k++)
+                if (k >= base && k - base < cells_count)
+                    mark[k - base] = 1;
+            continue;
+        }
+        for (size_t k = 0; k < cells_count; k++)
+            offsets[k] = UINT32_MAX;
+        line_layout(v->text, v->length, columns, v->row, v->count, cells, offsets);
+        for (size_t k = 0; k < cells_count; k++)
+            if (offsets[k] >= m->column && offsets[k] < m->column + m->length)
+                mark[k] = 1;
+    }
+    free(visible);
+    free(cells);
+    free(offsets);
+}
+
+/* Rows from the top of the history row holding byte `column` of history
+ * line `line` to the screen, the view that puts it at the top. */
+static size_t scrollback_line_distance(Scrollback *sb, size_t line, size_t column)
+{
+    const int columns = sb->columns;
+    size_t distance = pending_rows(sb);
+    size_t block = sb->count;
+    while (block > 0 && sb->blocks[block - 1]->first_line > line)
+        distance += scrollback_block_rows(sb, --block);
+    if (block == 0)
+        return distance;
+    const ScrollbackBlock *b = sb->blocks[block - 1];
+    const char *p = b->data;
+    const char *end = b->data + b->size;
+    size_t row = 0;
+    for (size_t l = b->first_line; p < end; l++) {
+        const char *nl = memchr(p, '\n', end - p);
+        const size_t length = nl - p;
+        const size_t rows = line_rows(p, length, columns);
+        if (l == line && column < length)
+            row = line_rows(p, column + 1, columns) - 1;
+        if (l >= line)
+            distance += rows;
+        p = nl + 1;
+    }
+    return distance - row;
+}
+
+static inline void damage_cells(Cells *cells, int row, int begin, int end)
+{
+    Damage *d = &cells->damage[row];
+    if (begin < d->begin)
+        d->begin = begin;
+    if (end > d->end)
+        d->end = end;
+}
+
+/* Sets the grid size with `top` at 0. The cell contents are left undefined;
+ * rows are unwrapped and fully damaged. */
+static void cells_resize_storage(Cells *cells, int columns, int rows)
+{
+    const size_t count = (size_t) columns * rows;
+    if (count > cells->capacity) {
+        cells->capacity = cells->capacity * 2 > count ? cells->capacity * 2 : count;
+        free(cells->cells);
+        cells->cells = malloc(sizeof(Cell) * cells->capacity);
+        if (cells->cells == NULL)
+            fatal("Malloc failed.");
+    }
+    if (rows > cells->row_capacity) {
+        cells->row_capacity = cells->row_capacity * 2 > rows ?
+                              cells->row_capacity * 2 : rows;
+        free(cells->wrapped);
+        free(cells->damage);
+        free(cells->stamps);
+        cells->wrapped = malloc(sizeof(bool) * cells->row_capacity);
+        cells->damage = malloc(sizeof(Damage) * cells->row_capacity);
+        cells->stamps = malloc(sizeof(uint32_t) * cells->row_capacity);
+        if (cells->wrapped == NULL || cells->damage == NULL || cells->stamps == NULL)
+            fatal("Malloc failed.");
+    }
+    cells->columns = columns;
+    cells->rows = rows;
+    cells->count = count;
+    cells->top = 0;
+    memset(cells->wrapped, 0, sizeof(bool) * rows);
+    for (int y = 0; y < rows; y++) {
+        cells->damage[y].begin = 0;
+        cells->damage[y].end = columns;
+        cells->stamps[y] = cells->generation;
+    }
+}
+
+static void init_cells(Cells *cells, int columns, int rows)
+{
+    memset(cells, 0, sizeof(Cells));
+    cells_resize_storage(cells, columns, rows);
+    fill_cells(cells->cells, CELL_BLANK, cells->count);
+    cells->blank = CELL_BLANK;
+}
+
+static inline int physical_row(const Cells *cells, int y)
+{
+    return (cells->top + y) % cells->rows;
+}
+
+static inline bool row_stale(const Cells *cells, int row)
+{
+    return cells->stamps[row] != cells->generation;
+}
+
+/* Fills in physical row `row` if a clear left it stale. */
+static inline void materialize_row(Cells *cells, int row)
+{
+    if (!row_stale(cells, row))
+        return;
+    fill_cells(cells->cells + (size_t) row * cells->columns, cells->blank,
+               cells->columns);
+    cells->wrapped[row] = false;
+    cells->stamps[row] = cells->generation;
+}
+
+static inline Cell *cells_row(Cells *cells, int y)
+{
+    const int row = physical_row(cells, y);
+    materialize_row(cells, row);
+    return &cells->cells[row * cells->columns];
+}
+
+/* Called before columns [begin, end) of row y are overwritten or moved: a
+ * wide character only partly inside loses its other half as well. */
+static void split_wide(Cells *cells, int y, int begin, int end)
+{
+    Cell *cell = cells_row(cells, y);
+    const int row = physical_row(cells, y);
+    if (begin > 0 && (cell_flags(cell[begin - 1]) & CELL_WIDE)) {
+        cell[begin - 1] = cell_make(' ', cell_style(cell[begin - 1]), 0);
+        damage_cells(cells, row, begin - 1, begin);
+    }
+    if (end > 0 && end < cells->columns && (cell_flags(cell[end - 1]) & CELL_WIDE)) {
+        cell[end] = cell_make(' ', cell_style(cell[end]), 0);
+        damage_cells(cells, row, end, end + 1);
+    }
+}
+
+/* Sets columns [begin, end) of row y to `blank`. A row erased to its end
+ * no longer continues on the next one. */
+static void erase_cells(Cells *cells, int y, int begin, int end, Cell blank)
+{
+    if (begin >= end)
+        return;
+    const int row = physical_row(cells, y);
+    split_wide(cells, y, begin, end);
+    fill_cells(cells_row(cells, y) + begin, blank, end - begin);
+    if (end == cells->columns)
+        cells->wrapped[row] = false;
+    damage_cells(cells, row, begin, end);
+}
+
+/* Sets the whole screen to `blank` without touching a row. Should the
+ * generation wrap around, every stamp is made stale by hand. */
+static void cells_clear(Cells *cells, Cell blank)
+{
+    if (++cells->generation == 0)
+        for (int y = 0; y < cells->rows; y++)
+            cells->stamps[y] = UINT32_MAX;
+    cells->blank = blank;
+    cells->damage_all = true;
+}
+
+static inline uint32_t style_hash(const Style *style)
+{
+    uint32_t h = style->fg * 0x9e3779b1u;
+    h = (h ^ style->bg) * 0x85ebca6bu;
+    h = (h ^ style->underline) * 0xc2b2ae35u;
+    h = (h ^ style->attrs) * 0x27d4eb2fu;
+    return h ^ (h >> 15);
+}
+
+/* slots is an open-addressed set of id + 1 with twice the capacity. */
+static void style_table_rehash(StyleTable *table)
+{
+    const size_t mask = table->capacity * 2 - 1;
+    memset(table->slots, 0, sizeof(uint32_t) * table->capacity * 2);
+    memset(table->marks, 0, table->capacity);
+    for (size_t i = 0; i < table->free_count; i++)
+        table->marks[table->free_ids[i]] = 1;
+    for (size_t id = 0; id < table->count; id++) {
+        if (table->marks[id])
+            continue;
+        size_t slot = style_hash(&table->styles[id]) & mask;
+        while (table->slots[slot])
+            slot = (slot + 1) & mask;
+        table->slots[slot] = id + 1;
+    }
+}
+
+static void style_table_grow(StyleTable *table)
+{
+    table->capacity = table->capacity ? table->capacity * 2 : 256;
+    table->styles = realloc(table->styles, sizeof(Style) * table->capacity);
+    table->free_ids = realloc(table->free_ids, sizeof(uint16_t) * table->capacity);
+    table->marks = realloc(table->marks, table->capacity);
+    free(table->slots);
+    table->slots = malloc(sizeof(uint32_t) * table->capacity * 2);
+    if (!table->styles || !table->free_ids || !table->marks || !table->slots)
+        fatal("Malloc failed.");
+    style_table_rehash(table);
+}
+
+/* Frees every style not referenced from either screen or the current pen.
+ * `other` is the inactive screen, or NULL. */
+/* Stale rows read as blank, and their storage may never have been
+ * written, so only the blank cell is marked for them. */
+static void mark_styles(StyleTable *table, const Cells *cells)
+{
+    table->marks[cell_style(cells->blank)] = 1;
+    for (int y = 0; y < cells->rows; y++) {
+        if (row_stale(cells, y))
+            continue;
+        const Cell *row = cells->cells + (size_t) y * cells->columns;
+        for (int x = 0; x < cells->columns; x++)
+            table->marks[cell_style(row[x])] = 1;
+    }
+}
+
+static void style_table_gc(StyleTable *table, const Cells *cells,
+                           const Cells *other, uint16_t pen)
+{
+    memset(table->marks, 0, table->capacity);
+    table->marks[STYLE_DEFAULT] = 1;
+    table->marks[pen] = 1;
+    mark_styles(table, cells);
+    if (other)
+        mark_styles(table, other);
+    table->free_count = 0;
+    for (size_t id = table->count; id-- > 0;)
+        if (!table->marks[id])
+            table->free_ids[table->free_count++] = id;
+    style_table_rehash(table);
+}
+
+static uint16_t style_intern(StyleTable *table, const Style *style,
+                             const Cells *cells, const Cells *other,
+                             uint16_t pen)
+{
+    if (table->capacity) {
+        const size_t mask = table->capacity * 2 - 1;
+        size_t slot = style_hash(style) & mask;
+        while (table->slots[slot]) {
+            const uint32_t id = table->slots[slot] - 1;
+            if (memcmp(&table->styles[id], style, sizeof(Style)) == 0)
+                return id;
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    if (table->free_count == 0 && table->count == table->capacity) {
+        if (cells)
+            style_table_gc(table, cells, other, pen);
+        if (table->free_count == 0) {
+            if (table->capacity == STYLE_MAX) {
+                log_info("Style table full, falling back to default style.");
+                return STYLE_DEFAULT;
+            }
+            style_table_grow(table);
+        }
+    }
+
+    uint16_t id;
+    if (table->free_count)
+        id = table->free_ids[--table->free_count];
+    else
+        id = table->count++;
+    table->styles[id] = *style;
+    table->version++;
+
+    const size_t mask = table->capacity * 2 - 1;
+    size_t slot = style_hash(style) & mask;
+    while (table->slots[slot])
+        slot = (slot + 1) & mask;
+    table->slots[slot] = id + 1;
+    return id;
+}
+
+static inline uint32_t cluster_hash(const Cluster *cluster)
+{
+    uint32_t h = 0;
+    for (int i = 0; i < CLUSTER_MAX && cluster->codepoints[i]; i++)
+        h = (h ^ cluster->codepoints[i]) * 0x9e3779b1u;
+    return h ^ (h >> 15);
+}
+
+/* slots is an open-addressed set of id + 1 with twice the capacity. */
+static void cluster_table_rehash(ClusterTable *table)
+{
+    const size_t mask = table->capacity * 2 - 1;
+    memset(table->slots, 0, sizeof(uint32_t) * table->capacity * 2);
+    memset(table->live, 1, table->capacity);
+    for (size_t i = 0; i < table->free_count; i++)
+        table->live[table->free_ids[i]] = 0;
+    for (size_t id = 1; id < table->count; id++) {
+        if (!table->live[id])
+            continue;
+        size_t slot = cluster_hash(&table->entries[id]) & mask;
+        while (table->slots[slot])
+            slot = (slot + 1) & mask;
+        table->slots[slot] = id + 1;
+    }
+}
+
+static void cluster_table_grow(ClusterTable *table)
+{
+    table->capacity = table->capacity ? table->capacity * 2 : 256;
+    table->entries = realloc(table->entries, sizeof(Cluster) * table->capacity);
+    table->free_ids = realloc(table->free_ids, sizeof(uint32_t) * table->capacity);
+    table->live = realloc(table->live, table->capacity);
+    free(table->slots);
+    table->slots = malloc(sizeof(uint32_t) * table->capacity * 2);
+    if (!table->entries || !table->free_ids || !table->live || !table->slots)
+        fatal("Malloc failed.");
+    if (table->count == 0)
+        table->count = 1;
+    cluster_table_rehash(table);
+}
+
+/* Like mark_styles(), stale rows only hold the blank cell. */
+static void mark_clusters(ClusterTable *table, const Cells *cells)
+{
+    table->live[cell_cluster(cells->blank)] = 1;
+    for (int y = 0; y < cells->rows; y++) {
+        if (row_stale(cells, y))
+            continue;
+        const Cell *row = cells->cells + (size_t) y * cells->columns;
+        for (int x = 0; x < cells->columns; x++)
+            table->live[cell_cluster(row[x])] = 1;
+    }
+}
+
+/* Frees every cluster not referenced from either screen. */
+static void cluster_table_gc(ClusterTable *table, const Cells *cells,
+                             const Cells *other)
+{
+    memset(table->live, 0, table->capacity);
+    mark_clusters(table, cells);
+    if (other)
+        mark_clusters(table, other);
+    table->free_count = 0;
+    for (size_t id = table->count; id-- > 1;)
+        if (!table->live[id])
+            table->free_ids[table->free_count++] = id;
+    cluster_table_rehash(table);
+}
+
+/* Returns the id of `cluster`, or 0 once the table is full of live ones. */
+static uint32_t cluster_intern(ClusterTable *table, const Cluster *cluster,
+                               const Cells *cells, const Cells *other)
+{
+    if (table->capacity) {
+        const size_t mask = table->capacity * 2 - 1;
+        size_t slot = cluster_hash(cluster) & mask;
+        while (table->slots[slot]) {
+            const uint32_t id = table->slots[slot] - 1;
+            if (memcmp(&table->entries[id], cluster, sizeof(Cluster)) == 0)
+                return id;
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    if (table->free_count == 0 && table->count == table->capacity) {
+        if (table->capacity)
+            cluster_table_gc(table, cells, other);
+        if (table->free_count == 0) {
+            if (table->capacity == CLUSTER_TABLE_MAX) {
+                log_info("Cluster table full, dropping cluster codepoints.");
+                return 0;
+            }
+            cluster_table_grow(table);
+        }
+    }
+
+    uint32_t id;
+    if (table->free_count)
+        id = table->free_ids[--table->free_count];
+    else
+        id = table->count++;
+    table->entries[id] = *cluster;
+
+    const size_t mask = table->capacity * 2 - 1;
+    size_t slot = cluster_hash(cluster) & mask;
+    while (table->slots[slot])
+        slot = (slot + 1) & mask;
+    table->slots[slot] = id + 1;
+    return id;
+}
+
+static void init_terminal(Terminal *t, int columns, int rows)
+{
+    memset(t, 0, sizeof(Terminal));
+    t->columns = columns;
+    t->rows = rows;
+    t->segmenter.last = GRAPHEME_CONTROL;
+    const Style default_style = {0};
+    t->style = style_intern(&t->styles, &default_style, NULL, NULL, STYLE_DEFAULT);
+}
+
+/* Writes a row as UTF-8, at most CELL_UTF8_MAX bytes a cell: each
+ * cell's grapheme cluster, cells without a printable codepoint as
+ * spaces and the second halves of wide characters as nothing. If `where`
+ * is not NULL it gets the column of every byte. */
+static size_t cells_text(const Cell *row, int columns,
+                         const ClusterTable *clusters, char *out, uint16_t *where)
+{
+    size_t size = 0;
+    for (int x = 0; x < columns; x++) {
+        const Cell cell = row[x];
+        if (cell_flags(cell) & CELL_SPACER)
+            continue;
+        const size_t begin = size;
+        const uint32_t codepoint = cell_codepoint(cell);
+        if (codepoint < ASCII_BEGIN || codepoint == 0x7f ||
+            (codepoint >= 0x80 && codepoint < 0xa0))
+            out[size++] = ' ';
+        else
+            size += utf8_encode(codepoint, out + size);
+        const uint32_t id = cell_cluster(cell);
+        for (int i = 0; id && i < CLUSTER_MAX && clusters->entries[id].codepoints[i]; i++)
+            size += utf8_encode(clusters->entries[id].codepoints[i], out + size);
+        for (size_t i = begin; where && i < size; i++)
+            where[i] = x;
+    }
+    return size;
+}
+
+static size_t row_text(Cells *cells, const ClusterTable *clusters, int columns,
+                       int y, char *out, uint16_t *where)
+{
+    return cells_text(cells_row(cells, y), columns, clusters, out, where);
+}
+
+/* Trailing blanks of a row that ends its logical line are dropped. */
+static void scrollback_push_row(Scrollback *sb, const Cell *row, int columns,
+                                const ClusterTable *clusters, bool wrapped)
+{
+    char text[columns * CELL_UTF8_MAX];
+    size_t size = cells_text(row, columns, clusters, text, NULL);
+    if (!wrapped)
+        while (size && text[size - 1] == ' ')
+            size--;
+    scrollback_push(sb, text, size, wrapped);
+}
+
+/* The alternate screen has no history; its rows scroll off for good. */
+static void scroll_up(Terminal *t, Cells *c, Scrollback *sb)
+{
+    const int top = c->top;
+    const Cell *row = cells_row(c, 0);
+    if (!t->alternate)
+        scrollback_push_row(sb, row, t->columns, &t->clusters, c->wrapped[top]);
+
+    /* The old top row becomes the new, blank bottom row. */
+    c->top = (top + 1) % t->rows;
+    fill_cells(c->cells + top * t->columns, CELL_BLANK, t->columns);
+    c->wrapped[top] = false;
+    damage_cells(c, top, 0, t->columns);
+}
+
+/* Reflows a screen to a new size: logical lines are rebuilt from the
+ * wrapped flags and wrapped again at the new width, with the cursor kept
+ * on the same cell of its line. Rows that no longer fit above the cursor
+ * go to the scrollback, or are dropped if `sb` is NULL. `wrap` carries a
+ * pending wrap across reflows that leave the cursor inside the screen. */
+static void reflow_screen(Cells *c, Scrollback *sb, const ClusterTable *clusters,
+                          size_t *cursor_x, size_t *cursor_y, bool *wrap,
+                          int columns, int rows)
+{
+    const int old_columns = c->columns;
+    const int old_rows = c->rows;
+    /* An old row spans at most this many new rows, one more for a cursor
+     * past the end of its line. A new row holds at least columns - 1 of
+     * its cells, the last one may be left blank before a wide character. */
+    const int step = columns > 1 ? columns - 1 : 1;
+    const size_t capacity = (size_t) old_rows * ((old_columns + step - 1) / step + 1);
+    Cell *old = malloc(sizeof(Cell) * old_columns * old_rows);
+    bool *old_wrapped = malloc(sizeof(bool) * old_rows);
+    Cell *lines = malloc(sizeof(Cell) * columns * capacity);
+    bool *wrapped = calloc(capacity, sizeof(bool));
+    if (old == NULL || old_wrapped == NULL || lines == NULL || wrapped == NULL)
+        fatal("Malloc failed.");
+    for (int y = 0; y < old_rows; y++) {
+        memcpy(old + (size_t) y * old_columns, cells_row(c, y),
+               sizeof(Cell) * old_columns);
+        old_wrapped[y] = c->wrapped[physical_row(c, y)];
+    }
+    fill_cells(lines, CELL_BLANK, columns * capacity);
+
+    /* A cursor waiting to wrap stays after the last cell of its line, and
+     * so does one an earlier reflow took out of the wait if it still
+     * follows the last cell. */
+    bool pending = *cursor_x >= (size_t) old_columns;
+    size_t count = 0;
+    size_t end = 0;
+    size_t cursor_row = 0;
+    size_t cursor_column = 0;
+    for (int first = 0; first < old_rows;) {
+        int last = first;
+        while (last < old_rows - 1 && old_wrapped[last])
+            last++;
+        /* The rows of a logical line are contiguous in `old`, and so are
+         * the rows it wraps into in `lines`. Old padding is dropped and a
+         * wide character that would straddle the new right edge is padded
+         * onto the next row. */
+        const Cell *line = old + (size_t) first * old_columns;
+        size_t length = (size_t) (last - first + 1) * old_columns;
+        while (length && line[length - 1] == CELL_BLANK)
+            length--;
+        const bool has_cursor = *cursor_y >= (size_t) first &&
+                                *cursor_y <= (size_t) last;
+        size_t offset = has_cursor ? (*cursor_y - first) * old_columns +
+                                     *cursor_x - pending : SIZE_MAX;
+        if (has_cursor && *wrap && !pending && length && offset == length) {
+            pending = true;
+            offset--;
+        }
+        Cell *out = lines + count * columns;
+        size_t position = 0;
+        size_t n = 0;
+        for (size_t k = 0; k < length; k++) {
+            const uint32_t flags = cell_flags(line[k]);
+            if ((flags & CELL_SPACER) && (k == 0 || !(cell_flags(line[k - 1]) & CELL_WIDE))) {
+                if (k == offset)
+                    position = n;
+                continue;
+            }
+            if (columns > 1 && (flags & CELL_WIDE) && n % columns == (size_t) columns - 1)
+                out[n++] = cell_make(0, STYLE_DEFAULT, CELL_SPACER);
+            if (k == offset)
+                position = n;
+            out[n++] = line[k];
+        }
+        if (has_cursor && offset >= length)
+            position = n + offset - length;
+        size_t line_rows = n ? (n + columns - 1) / columns : 1;
+        if (n)
+            end = count + line_rows;
+
+        if (has_cursor) {
+            if (position / columns + 1 > line_rows)
+                line_rows = position / columns + 1;
+            cursor_row = count + position / columns;
+            cursor_column = position % columns + pending;
+            if (cursor_row + 1 > end)
+                end = cursor_row + 1;
+        }
+        for (size_t k = 0; k + 1 < line_rows; k++)
+            wrapped[count + k] = true;
+        wrapped[count + line_rows - 1] = old_wrapped[last];
+        count += line_rows;
+        first = last + 1;
+    }
+
+    size_t start = end > (size_t) rows ? end - rows : 0;
+    if (start > cursor_row)
+        start = cursor_row;
+    for (size_t y = 0; sb && y < start; y++)
+        scrollback_push_row(sb, lines + y * columns, columns, clusters, wrapped[y]);
+
+    cells_resize_storage(c, columns, rows);
+    fill_cells(c->cells, CELL_BLANK, c->count);
+    const size_t used = end - start < (size_t) rows ? end - start : (size_t) rows;
+    memcpy(c->cells, lines + start * columns, sizeof(Cell) * columns * used);
+    memcpy(c->wrapped, wrapped + start, sizeof(bool) * used);
+    *cursor_y = cursor_row - start;
+    *cursor_x = cursor_column;
+    *wrap = pending && cursor_column < (size_t) columns;
+
+    free(old);
+    free(old_wrapped);
+    free(lines);
+    free(wrapped);
+}
+
+/* While the alternate screen is shown the primary one reflows around the
+ * saved cursor, which is the cursor it will be restored with. */
+static void resize_terminal(Terminal *t, Cells *c, Scrollback *sb,
+                            int columns, int rows)
+{
+    scrollback_set_columns(sb, columns);
+    t->segmenter.last = GRAPHEME_CONTROL;
+    if (t->alternate) {
+        reflow_screen(t->inactive, sb, &t->clusters, &t->saved.cursor_x,
+                      &t->saved.cursor_y, &t->saved.reflow_wrap, columns, rows);
+        reflow_screen(c, NULL, &t->clusters, &t->cursor_x, &t->cursor_y,
+                      &t->reflow_wrap, columns, rows);
+    } else {
+        reflow_screen(c, sb, &t->clusters, &t->cursor_x, &t->cursor_y,
+                      &t->reflow_wrap, columns, rows);
+    }
+    t->columns = columns;
+    t->rows = rows;
+}
+
+static void line_feed(Terminal *t, Cells *c, Scrollback *sb)
+{
+    t->cursor_y++;
+    if (t->cursor_y >= (size_t) t->rows) {
+        scroll_up(t, c, sb);
+        t->cursor_y = t->rows - 1;
+    }
+}
+
+/* Parses an extended color after 38/48/58 starting at params[*i], either
+ * `;5;n` / `;2;r;g;b` or the colon forms `:5:n` / `:2:[cs]:r:g:b`. */
+static uint32_t sgr_color(const Terminal *t, int *i)
+{
+    const int *p = t->params;
+    int next = *i + 1;
+    if (next >= t->param_count)
+        return COLOR_DEFAULT;
+
+    if (t->subparams[next]) {
+        int end = next;
+        while (end + 1 < t->param_count && t->subparams[end + 1])
+            end++;
+        *i = end;
+        const int count = end - next + 1;
+        if (p[next] == 5 && count >= 2)
+            return COLOR_PALETTE | (p[next + 1] & 0xff);
+        if (p[next] == 2 && count >= 4) {
+            const int *rgb = &p[end - 2];
+            return COLOR_RGB | (rgb[0] & 0xff) << 16 | (rgb[1] & 0xff) << 8 | (rgb[2] & 0xff);
+        }
+        return COLOR_DEFAULT;
+    }
+
+    if (p[next] == 5 && next + 1 < t->param_count) {
+        *i = next + 1;
+        return COLOR_PALETTE | (p[next + 1] & 0xff);
+    }
+    if (p[next] == 2 && next + 3 < t->param_count) {
+        *i = next + 3;
+        return COLOR_RGB | (p[next + 1] & 0xff) << 16 |
+               (p[next + 2] & 0xff) << 8 | (p[next + 3] & 0xff);
+    }
+    *i = next;
+    return COLOR_DEFAULT;
+}
+
+static void select_graphic_rendition(Terminal *t, const Cells *c)
+{
+    Style *pen = &t->pen;
+    if (t->param_count == 0)
+        t->param_count = 1;
+    for (int i = 0; i < t->param_count; i++) {
+        const int p = t->params[i];
+        if (t->subparams[i])
+            continue;
+        switch (p) {
+            case 0: memset(pen, 0, sizeof(Style)); break;
+            case 1: pen->attrs |= ATTR_BOLD; break;
+            case 2: pen->attrs |= ATTR_DIM; break;
+            case 3: pen->attrs |= ATTR_ITALIC; break;
+            case 4:
+                if (i + 1 < t->param_count && t->subparams[i + 1] &&
+                    t->params[i + 1] == 0)
+                    pen->attrs &= ~ATTR_UNDERLINE;
+                else
+                    pen->attrs |= ATTR_UNDERLINE;
+                break;
+            case 7: pen->attrs |= ATTR_INVERSE; break;
+            case 9: pen->attrs |= ATTR_STRIKETHROUGH; break;
+            case 21: pen->attrs |= ATTR_UNDERLINE; break;
+            case 22: pen->attrs &= ~(ATTR_BOLD | ATTR_DIM); break;
+            case 23: pen->attrs &= ~ATTR_ITALIC; break;
+            case 24: pen->attrs &= ~ATTR_UNDERLINE; break;
+            case 27: pen->attrs &= ~ATTR_INVERSE; break;
+            case 29: pen->attrs &= ~ATTR_STRIKETHROUGH; break;
+            case 38: pen->fg = sgr_color(t, &i); break;
+            case 39: pen->fg = COLOR_DEFAULT; break;
+            case 48: pen->bg = sgr_color(t, &i); break;
+            case 49: pen->bg = COLOR_DEFAULT; break;
+            case 58: pen->underline = sgr_color(t, &i); break;
+            case 59: pen->underline = COLOR_DEFAULT; break;
+            default:
+                if (p >= 30 && p <= 37)
+                    pen->fg = COLOR_PALETTE | (p - 30);
+                else if (p >= 40 && p <= 47)
+                    pen->bg = COLOR_PALETTE | (p - 40);
+                else if (p >= 90 && p <= 97)
+                    pen->fg = COLOR_PALETTE | (p - 90 + 8);
+                else if (p >= 100 && p <= 107)
+                    pen->bg = COLOR_PALETTE | (p - 100 + 8);
+        }
+    }
+    t->style = style_intern(&t->styles, pen, c, t->inactive, t->style);
+}
+
+static void save_cursor(Terminal *t)
+{
+    t->saved.cursor_x = t->cursor_x;
+    t->saved.cursor_y = t->cursor_y;
+    t->saved.reflow_wrap = t->reflow_wrap;
+    t->saved.pen = t->pen;
+}
+
+/* The saved position may predate a resize of this screen. */
+static void restore_cursor(Terminal *t, const Cells *c)
+{
+    t->cursor_x = t->saved.cursor_x;
+    t->cursor_y = t->saved.cursor_y;
+    t->reflow_wrap = t->saved.reflow_wrap;
+    if (t->cursor_x > (size_t) t->columns)
+        t->cursor_x = t->columns;
+    if (t->cursor_y >= (size_t) t->rows)
+        t->cursor_y = t->rows - 1;
+    t->pen = t->saved.pen;
+    t->style = style_intern(&t->styles, &t->pen, c, t->inactive, t->style);
+}
+
+/* Erased cells keep the pen's background color and nothing else. */
+static Cell blank_cell(Terminal *t, const Cells *c)
+{
+    if (t->pen.bg == COLOR_DEFAULT)
+        return CELL_BLANK;
+    const Style style = {.bg = t->pen.bg};
+    return cell_make(' ', style_intern(&t->styles, &style, c, t->inactive,
+                                       t->style), 0);
+}
+
+/* DECSET 1049: saves the cursor and shows a cleared alternate screen. Only
+ * the screen pointers are swapped, so the primary screen and its
+ * scrollback are left exactly as they were. */
+static void enter_alternate_screen(Terminal *t, Cells **screen)
+{
+    if (t->alternate)
+        return;
+    save_cursor(t);
+    const Cell blank = blank_cell(t, *screen);
+    Cells *alternate = t->inactive;
+    if (alternate == NULL) {
+        alternate = malloc(sizeof(Cells));
+        if (alternate == NULL)
+            fatal("Malloc failed.");
+        init_cells(alternate, t->columns, t->rows);
+    } else {
+        cells_resize_storage(alternate, t->columns, t->rows);
+    }
+    cells_clear(alternate, blank);
+    t->inactive = *screen;
+    *screen = alternate;
+    t->alternate = true;
+}
+
+/* The alternate screen is kept for the next switch. */
+static void leave_alternate_screen(Terminal *t, Cells **screen)
+{
+    if (!t->alternate)
+        return;
+    Cells *primary = t->inactive;
+    t->inactive = *screen;
+    *screen = primary;
+    t->alternate = false;
+    restore_cursor(t, primary);
+}
+
+/* CUP: 1-based row and column, 0 or missing meaning 1. */
+static void cursor_position(Terminal *t)
+{
+    int row = t->param_count > 0 ? t->params[0] : 0;
+    int column = t->param_count > 1 ? t->params[1] : 0;
+    row = row < 1 ? 1 : row > t->rows ? t->rows : row;
+    column = column < 1 ? 1 : column > t->columns ? t->columns : column;
+    t->cursor_y = row - 1;
+    t->cursor_x = column - 1;
+}
+
+/* The first parameter as a count, 0 or missing meaning 1. */
+static inline int csi_count(const Terminal *t)
+{
+    return t->param_count && t->params[0] ? t->params[0] : 1;
+}
+
+/* The cursor column for editing and erasing, on the last column while a
+ * wrap is pending, which EL 0 and ED 0 erase as xterm does. */
+static inline int edit_column(const Terminal *t)
+{
+    return t->cursor_x < (size_t) t->columns ? (int) t->cursor_x : t->columns - 1;
+}
+
+/* ED. Erasing everything, or everything from the home position, is an O(1)
+ * clear. ED 3 erases the screen but keeps the scrollback: sealed blocks
+ * are shared with search and reflow jobs still running on the pool. */
+static void erase_display(Terminal *t, Cells *c)
+{
+    const int mode = t->param_count ? t->params[0] : 0;
+    const int x = edit_column(t);
+    const int y = (int) t->cursor_y;
+    const Cell blank = blank_cell(t, c);
+    if (mode == 2 || mode == 3 || (mode == 0 && x == 0 && y == 0)) {
+        cells_clear(c, blank);
+    } else if (mode == 0) {
+        erase_cells(c, y, x, t->columns, blank);
+        for (int row = y + 1; row < t->rows; row++)
+            erase_cells(c, row, 0, t->columns, blank);
+    } else if (mode == 1) {
+        for (int row = 0; row < y; row++)
+            erase_cells(c, row, 0, t->columns, blank);
+        erase_cells(c, y, 0, x + 1, blank);
+    }
+}
+
+/* EL. */
+static void erase_line(Terminal *t, Cells *c)
+{
+    const int mode = t->param_count ? t->params[0] : 0;
+    const int x = edit_column(t);
+    const int y = (int) t->cursor_y;
+    const Cell blank = blank_cell(t, c);
+    if (mode == 0)
+        erase_cells(c, y, x, t->columns, blank);
+    else if (mode == 1)
+        erase_cells(c, y, 0, x + 1, blank);
+    else if (mode == 2)
+        erase_cells(c, y, 0, t->columns, blank);
+}
+
+/* ECH: blanks cells from the cursor on without moving anything. */
+static void erase_characters(Terminal *t, Cells *c)
+{
+    const int x = edit_column(t);
+    const int n = csi_count(t);
+    const int end = n < t->columns - x ? x + n : t->columns;
+    erase_cells(c, (int) t->cursor_y, x, end, blank_cell(t, c));
+}
+
+/* ICH and DCH: the rest of the row is moved right, or left, by `n` cells
+ * with one memmove, and the cells opened up are blanked. Only the span
+ * from the cursor to the end of the row is damaged. */
+static void insert_characters(Terminal *t, Cells *c)
+{
+    const int x = edit_column(t);
+    int n = csi_count(t);
+    if (n > t->columns - x)
+        n = t->columns - x;
+    split_wide(c, (int) t->cursor_y, x, x);
+    split_wide(c, (int) t->cursor_y, t->columns - n, t->columns);
+    Cell *row = cells_row(c, (int) t->cursor_y);
+    memmove(row + x + n, row + x, sizeof(Cell) * (t->columns - x - n));
+    fill_cells(row + x, blank_cell(t, c), n);
+    damage_cells(c, physical_row(c, (int) t->cursor_y), x, t->columns);
+}
+
+static void delete_characters(Terminal *t, Cells *c)
+{
+    const int x = edit_column(t);
+    int n = csi_count(t);
+    if (n > t->columns - x)
+        n = t->columns - x;
+    split_wide(c, (int) t->cursor_y, x, x + n);
+    Cell *row = cells_row(c, (int) t->cursor_y);
+    memmove(row + x, row + x + n, sizeof(Cell) * (t->columns - x - n));
+    fill_cells(row + t->columns - n, blank_cell(t, c), n);
+    damage_cells(c, physical_row(c, (int) t->cursor_y), x, t->columns);
+}
+
+/* DECALN: fills the screen with 'E' and homes the cursor. Every row is
+ * overwritten, so stale rows are stamped rather than filled in first. */
+static void screen_alignment(Terminal *t, Cells *c)
+{
+    fill_cells(c->cells, cell_make('E', STYLE_DEFAULT, 0), c->count);
+    for (int row = 0; row < c->rows; row++) {
+        c->wrapped[row] = false;
+        c->stamps[row] = c->generation;
+        damage_cells(c, row, 0, c->columns);
+    }
+    t->cursor_x = 0;
+    t->cursor_y = 0;
+}
+
+/* RIS: back to the primary screen, cleared, with default modes and pen. */
+static void reset_terminal(Terminal *t, Cells **screen)
+{
+    leave_alternate_screen(t, screen);
+    cells_clear(*screen, CELL_BLANK);
+    t->cursor_x = 0;
+    t->cursor_y = 0;
+    memset(&t->pen, 0, sizeof(Style));
+    t->style = STYLE_DEFAULT;
+    t->reverse = false;
+    memset(&t->saved, 0, sizeof(SavedCursor));
+}
+
+static void set_mode(Terminal *t, Cells **screen, bool enable)
+{
+    if (t->private_marker != '?')
+        return;
+    for (int i = 0; i < t->param_count; i++) {
+        switch (t->params[i]) {
+            case 5: t->reverse = enable; break;
+            case 1048:
+                if (enable)
+                    save_cursor(t);
+                else
+                    restore_cursor(t, *screen);
+                break;
+            case 1049:
+                if (enable)
+                    enter_alternate_screen(t, screen);
+                else
+                    leave_alternate_screen(t, screen);
+                break;
+        }
+    }
+}
+
+static void dispatch_csi(Terminal *t, Cells **screen, char final)
+{
+    switch (final) {
+        case 'm':
+            if (t->private_marker == 0)
+                select_graphic_rendition(t, *screen);
+            break;
+        case 'h': set_mode(t, screen, true); break;
+        case 'l': set_mode(t, screen, false); break;
+        case 'H':
+        case 'f':
+            if (t->private_marker == 0)
+                cursor_position(t);
+            break;
+        case 'J':
+            if (t->private_marker == 0)
+                erase_display(t, *screen);
+            break;
+        case 'K':
+            if (t->private_marker == 0)
+                erase_line(t, *screen);
+            break;
+        case 'X':
+            if (t->private_marker == 0)
+                erase_characters(t, *screen);
+            break;
+        case '@':
+            if (t->private_marker == 0)
+                insert_characters(t, *screen);
+            break;
+        case 'P':
+            if (t->private_marker == 0)
+                delete_characters(t, *screen);
+            break;
+    }
+}
+
+static void csi_byte(Terminal *t, Cells **screen, char b)
+{
+    if (b >= '0' && b <= '9') {
+        if (t->param_count == 0)
+            t->param_count = 1;
+        int *p = &t->params[t->param_count - 1];
+        if (*p < 65535)
+            *p = *p * 10 + (b - '0');
+    } else if (b == ';' || b == ':') {
+        if (t->param_count == 0)
+            t->param_count = 1;
+        if (t->param_count < CSI_PARAMS_MAX) {
+            t->subparams[t->param_count] = b == ':';
+            t->params[t->param_count++] = 0;
+        }
+    } else if (b >= 0x3c && b <= 0x3f) {
+        t->private_marker = b;
+    } else if (b >= 0x40 && b <= 0x7e) {
+        dispatch_csi(t, screen, b);
+        t->state = STATE_GROUND;
+    } else if (b == 0x18 || b == 0x1a) {
+        t->state = STATE_GROUND;
+    }
+}
+
+/* Moves a cursor waiting past the last column to the start of the next
+ * row, which the current row now continues on. */
+static void wrap_cursor(Terminal *t, Cells *c, Scrollback *sb)
+{
+    const int row = physical_row(c, t->cursor_y);
+    materialize_row(c, row);
+    c->wrapped[row] = true;
+    t->cursor_x = 0;
+    line_feed(t, c, sb);
+}
+
+/* Writes a run of printable ASCII a row at a time, so wide characters at
+ * the edges are split and the damage recorded once per row. Each byte is
+ * a cluster of its own, so segmentation only notes that the last one may
+ * take combining marks. */
+static void write_ascii(Terminal *t, Cells *c, Scrollback *sb,
+                        const char *text, size_t size)
+{
+    while (size) {
+        if (t->cursor_x >= (size_t) t->columns)
+            wrap_cursor(t, c, sb);
+        const int x = t->cursor_x;
+        const int y = t->cursor_y;
+        const int n = size < (size_t) (t->columns - x) ? (int) size : t->columns - x;
+        split_wide(c, y, x, x + n);
+        Cell *row = cells_row(c, y) + x;
+        for (int k = 0; k < n; k++)
+            row[k] = cell_make((unsigned char) text[k], t->style, 0);
+        damage_cells(c, physical_row(c, y), x, x + n);
+        t->cursor_x += n;
+        text += n;
+        size -= n;
+    }
+    t->segmenter = (Segmenter) {GRAPHEME_OTHER, false, false};
+}
+
+/* Appends a codepoint to the cluster in the cell before the cursor,
+ * widening the cell into the next column if the cluster becomes wide and
+ * the row has room. It is dropped at the start of a row, or when the
+ * cluster already has CLUSTER_MAX codepoints after its first. */
+static void extend_cluster(Terminal *t, Cells *c, uint32_t codepoint)
+{
+    int x = t->cursor_x < (size_t) t->columns ? (int) t->cursor_x : t->columns;
+    if (x == 0)
+        return;
+    const int y = t->cursor_y;
+    Cell *row = cells_row(c, y);
+    x--;
+    if (x > 0 && (cell_flags(row[x]) & CELL_SPACER))
+        x--;
+    const Cell cell = row[x];
+    Cluster cluster = {{0}};
+    if (cell_cluster(cell))
+        cluster = t->clusters.entries[cell_cluster(cell)];
+    int count = 0;
+    while (count < CLUSTER_MAX && cluster.codepoints[count])
+        count++;
+    if (count == CLUSTER_MAX)
+        return;
+    cluster.codepoints[count] = codepoint;
+    const uint32_t id = cluster_intern(&t->clusters, &cluster, c, t->inactive);
+    if (id == 0)
+        return;
+    uint32_t flags = cell_flags(cell) & ((1u << CELL_CLUSTER_SHIFT) - 1);
+    int end = x + 1;
+    if (!(flags & CELL_WIDE) && end < t->columns &&
+        cluster_widens(cell_codepoint(cell), codepoint)) {
+        split_wide(c, y, end, end + 1);
+        row[end] = cell_make(0, cell_style(cell), CELL_SPACER);
+        flags |= CELL_WIDE;
+        t->cursor_x = ++end;
+    }
+    row[x] = cell_make(cell_codepoint(cell), cell_style(cell),
+                       flags | id << CELL_CLUSTER_SHIFT);
+    damage_cells(c, physical_row(c, y), x, end);
+}
+
+/* Writes a decoded codepoint from U+00A0 up; C1 controls are ignored. A
+ * codepoint that continues the grapheme cluster before the cursor joins
+ * its cell, and zero width ones that would start a cluster are dropped.
+ * A wide character takes a cell and a spacer, and one that does not fit
+ * on the row pads its last cell and wraps. */
+static void put_codepoint(Terminal *t, Cells *c, Scrollback *sb,
+                          uint32_t codepoint)
+{
+    if (codepoint < 0xa0)
+        return;
+    const int property = grapheme_property(codepoint);
+    const bool continues = grapheme_continues(&t->segmenter, property);
+    segmenter_push(&t->segmenter, property, continues);
+    if (continues) {
+        extend_cluster(t, c, codepoint);
+        return;
+    }
+    int width = codepoint_width(codepoint);
+    if (width == 0) {
+        t->segmenter.last = GRAPHEME_CONTROL;
+        return;
+    }
+    if (width > t->columns)
+        width = 1;
+    if (t->cursor_x + width > (size_t) t->columns) {
+        if (t->cursor_x < (size_t) t->columns) {
+            const int x = t->cursor_x;
+            split_wide(c, t->cursor_y, x, x + 1);
+            cells_row(c, t->cursor_y)[x] = cell_make(0, STYLE_DEFAULT, CELL_SPACER);
+            damage_cells(c, physical_row(c, t->cursor_y), x, x + 1);
+        }
+        wrap_cursor(t, c, sb);
+    }
+    const int x = t->cursor_x;
+    const int y = t->cursor_y;
+    split_wide(c, y, x, x + width);
+    Cell *row = cells_row(c, y);
+    row[x] = cell_make(codepoint, t->style, width == 2 ? CELL_WIDE : 0);
+    if (width == 2)
+        row[x + 1] = cell_make(0, t->style, CELL_SPACER);
+    damage_cells(c, physical_row(c, y), x, x + width);
+    t->cursor_x += width;
+}
+
+/* `*screen` is the screen being written. Mode switches may swap it for
+ * the other screen. */
+static void write_to_terminal(Terminal *t, Cells **screen, Scrollback *sb,
+                              void *buf, size_t size)
+{
+    char *b = buf;
+    Cells *c = *screen;
+    if (size)
+        t->reflow_wrap = false;
+    for(size_t i = 0; i < size; i++) {
+        switch (t->state) {
+            case STATE_ESCAPE:
+                if (b[i] == '[') {
+                    t->state = STATE_CSI;
+                    t->param_count = 0;
+                    t->private_marker = 0;
+                    memset(t->params, 0, sizeof(t->params));
+                    memset(t->subparams, 0, sizeof(t->subparams));
+                } else if (b[i] == ']') {
+                    t->state = STATE_OSC;
+                } else if (b[i] == '7') {
+                    save_cursor(t);
+                    t->state = STATE_GROUND;
+                } else if (b[i] == '8') {
+                    restore_cursor(t, c);
+                    t->state = STATE_GROUND;
+                } else if (b[i] == 'c') {
+                    reset_terminal(t, screen);
+                    c = *screen;
+                    t->state = STATE_GROUND;
+                } else if (b[i] == '#') {
+                    t->state = STATE_ESCAPE_HASH;
+                } else {
+                    t->state = STATE_GROUND;
+                }
+                continue;
+            case STATE_ESCAPE_HASH:
+                if (b[i] == '8')
+                    screen_alignment(t, c);
+                t->state = STATE_GROUND;
+                continue;
+            case STATE_CSI:
+                csi_byte(t, screen, b[i]);
+                c = *screen;
+                continue;
+            case STATE_OSC:
+                /* Operating system commands end with BEL or ESC \. */
+                if (b[i] == '\a')
+                    t->state = STATE_GROUND;
+                else if (b[i] == 0x1b)
+                    t->state = STATE_ESCAPE;
+                continue;
+            case STATE_GROUND:
+                break;
+        }
+
+        /* A byte that does not continue a sequence ends it as U+FFFD and
+         * is then taken on its own. */
+        const unsigned char byte = b[i];
+        if (t->utf8_remaining) {
+            if ((byte & 0xc0) == 0x80) {
+                t->utf8_codepoint = t->utf8_codepoint << 6 | (byte & 0x3f);
+                if (--t->utf8_remaining == 0)
+                    put_codepoint(t, c, sb, utf8_valid(t->utf8_codepoint, t->utf8_length) ?
+                                            t->utf8_codepoint : REPLACEMENT_CHARACTER);
+                continue;
+            }
+            t->utf8_remaining = 0;
+            put_codepoint(t, c, sb, REPLACEMENT_CHARACTER);
+        }
+
+        if (is_printable_ascii(b[i])) {
+            size_t n = 1;
+            while (i + n < size && is_printable_ascii(b[i + n]))
+                n++;
+            write_ascii(t, c, sb, b + i, n);
+            i += n - 1;
+        } else if (byte >= 0x80) {
+            t->utf8_length = utf8_lead(byte, &t->utf8_codepoint);
+            if (t->utf8_length == 0)
+                put_codepoint(t, c, sb, REPLACEMENT_CHARACTER);
+            else
+                t->utf8_remaining = t->utf8_length - 1;
+        } else {
+            /* Controls and escape sequences end the cluster before the
+             * cursor, which they may move. */
+            t->segmenter.last = GRAPHEME_CONTROL;
+            if (b[i] == '\n') {
+                t->cursor_x = 0;
+                line_feed(t, c, sb);
+            } else if (b[i] == '\r') {
+                t->cursor_x = 0;
+            } else if (b[i] == '\b') {
+                if (t->cursor_x > 0)
+                    t->cursor_x--;
+            } else if (b[i] == 0x1b) {
+                t->state = STATE_ESCAPE;
+            }
+        }
+    }
+}
+
+/* Like memmem(), but tests 16 candidate positions per step by matching the
+ * first and last needle bytes before falling back to memcmp(). */
+static const char *find_literal(const char *s, size_t n,
+                                const char *needle, size_t m)
+{
+    if (m == 0 || m > n)
+        return NULL;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+        const __m128i b = _mm_loadu_si128((const __m128i *) (s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            if (memcmp(s + i + bit, needle, m) == 0)
+                return s + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i + m <= n) {
+        const char *p = memchr(s + i, needle[0], n - m + 1 - i);
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, needle, m) == 0)
+            return p;
+        i = p - s + 1;
+    }
+    return NULL;
+}
+
+static void matches_push(SearchMatches *m, size_t line, size_t column,
+                         size_t length)
 {
-    FT_Library ft;
-    FT_Error error;
-    error = FT_Init_FreeType(&ft);
-    if (error)
-        fatal("Failed to init FreeType2.");
-    FT_Face face;
-    error = FT_New_Face(ft, font_path, 0, &face);
-    if (error)
-        fatal("Failed to load font: %s", font_path);
-    if (!FT_IS_FIXED_WIDTH(face))
-        fatal("Font should be a monospace font.");
-    error = FT_Set_Char_Size(
-          face,    /* handle to face object         */
-          0,       /* char_width in 1/64 of points  */
-          font_size * 64,   /* char_height in 1/64 of points */
-          96,     /* horizontal device resolution  */
-          96);    /* vertical device resolution    */
-    if (error)
-        fatal("Failed to set font size");
-
-    int atlas_width = 0;
-
-    for (int i = ASCII_BEGIN; i <= ASCII_END; i++) {
-        error = FT_Load_Char(face, i, FT_LOAD_RENDER);
-        if (error)
-            fatal("Failed to load char: %c", i);
-
-        Character *c = &font->chars[i - ASCII_BEGIN];
-        c->c = i;
-        c->bearing.x = face->glyph->bitmap_left;
-        c->bearing.y = face->glyph->bitmap_top;
-        
-        c->bitmap.width = face->glyph->bitmap.width;
-        atlas_width += c->bitmap.width;
-        c->bitmap.height = face->glyph->bitmap.rows;
-        c->width = (face->glyph->metrics.width >> 6);
-        c->height = (face->glyph->metrics.height >> 6);
-        
-        const size_t size = c->bitmap.width * c->bitmap.height;
-        c->bitmap.data = malloc(size);
-        memcpy(c->bitmap.data, face->glyph->bitmap.buffer, size);
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : 64;
+        m->items = realloc(m->items, sizeof(SearchMatch) * m->capacity);
+        if (m->items == NULL)
+            fatal("Realloc failed.");
     }
-
-    font->char_width = face->glyph->advance.x >> 6;
-    font->char_height= (face->size->metrics.ascender - face->size->metrics.descender)>> 6;
-    font->atlas_width = atlas_width;
-
-    FT_Done_Face(face);
-    FT_Done_FreeType(ft);
+    SearchMatch *match = &m->items[m->count++];
+    match->line = line;
+    match->column = column;
+    match->length = length;
 }
 
-static void check_shader_errors(GLuint shader, GLenum type)
+/* Finds all matches in '\n'-separated, NUL-terminated text whose first line
+ * is `line`. `re` is used when non-NULL, otherwise `query` is literal. */
+static void search_text(const char *text, size_t size, size_t line,
+                        const char *query, size_t query_size, regex_t *re,
+                        SearchMatches *out)
 {
-    GLint success = 0;
-    GLint info_log_length = 0;
-    char *info_log = NULL;
-
-    if (type == GL_VERTEX_SHADER || type == GL_FRAGMENT_SHADER) {
-        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-        if (!success) {
-            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
-            info_log = malloc(info_log_length);
-            info_log[info_log_length - 1] = '\0';
-            glGetShaderInfoLog(shader, info_log_length, NULL, info_log);
-            if (type == GL_VERTEX_SHADER)
-                fatal("Vertex shader error: \n%s", info_log);
-            else
-                fatal("Fragment shader error: \n%s", info_log);
+    const char *end = text + size;
+    const char *line_start = text;
+    const char *p = text;
+    int eflags = 0;
+    while (p < end) {
+        const char *found;
+        size_t length;
+        if (re) {
+            regmatch_t m;
+            if (regexec(re, p, 1, &m, eflags) != 0)
+                break;
+            found = p + m.rm_so;
+            length = m.rm_eo - m.rm_so;
+        } else {
+            found = find_literal(p, end - p, query, query_size);
+            if (found == NULL)
+                break;
+            length = query_size;
         }
-    } else if(type == GL_PROGRAM) {
-        glGetProgramiv(shader, GL_LINK_STATUS, &success);
-        if (!success) {
-            glGetProgramiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
-            info_log = malloc(info_log_length);
-            info_log[info_log_length - 1] = '\0';
-            glGetProgramInfoLog(shader, info_log_length, NULL, info_log);
-            fatal("Shader program linking error: \n%s", info_log);
+
+        const char *nl;
+        while ((nl = memchr(line_start, '\n', found - line_start))) {
+            line++;
+            line_start = nl + 1;
         }
+        if (length)
+            matches_push(out, line, found - line_start, length);
+        p = found + (length ? length : 1);
+        eflags = (p > text && p[-1] == '\n') ? 0 : REG_NOTBOL;
     }
 }
 
-static GLuint create_shader_program(const char *vertex_src,
-                                    const char *fragment_src)
+static bool search_job_cancelled(SearchJob *job)
 {
-    GLuint vertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex, 1, (const GLchar * const *) &vertex_src, NULL);
-    glCompileShader(vertex);
-    check_shader_errors(vertex, GL_VERTEX_SHADER);
+    pthread_mutex_lock(&job->search->lock);
+    bool cancelled = job->cancelled;
+    pthread_mutex_unlock(&job->search->lock);
+    return cancelled;
+}
 
-    GLuint fragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment, 1, (const GLchar * const *) &fragment_src, NULL);
-    glCompileShader(fragment);
-    check_shader_errors(fragment, GL_FRAGMENT_SHADER);
+static void search_block_task(void *arg, size_t task, int worker)
+{
+    SearchJob *job = arg;
+    if (search_job_cancelled(job))
+        return;
 
-    GLuint program = glCreateProgram();
-    glAttachShader(program, vertex);
-    glAttachShader(program, fragment);
-    glLinkProgram(program);
-    check_shader_errors(program, GL_PROGRAM);
+    regex_t *re = NULL;
+    if (job->regex) {
+        re = &job->regexes[worker];
+        if (!job->compiled[worker]) {
+            if (regcomp(re, job->query, REG_EXTENDED | REG_NEWLINE) != 0)
+                return;
+            job->compiled[worker] = true;
+        }
+    }
 
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
-    return program;
+    const ScrollbackBlock *block = job->blocks[task];
+    if (job->trigram_count && pool_done(job->search->pool, &block->index_batch) &&
+        block->bloom && !bloom_may_contain(block->bloom, job->trigrams,
+                                           job->trigram_count))
+        return;
+
+    SearchMatches found = {0};
+    search_text(block->data, block->size, block->first_line,
+                job->query, job->query_size, re, &found);
+
+    if (found.count) {
+        Search *s = job->search;
+        pthread_mutex_lock(&s->lock);
+        if (!job->cancelled)
+            for (size_t i = 0; i < found.count; i++)
+                matches_push(&s->matches, found.items[i].line,
+                             found.items[i].column, found.items[i].length);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(found.items);
 }
 
-static void ortho(float *m, float left, float right, float bottom, float top,
-                  float near, float far)
+static size_t push_trigrams(const char *run, size_t size, uint32_t *out,
+                            size_t count)
 {
-    memset(m, 0, 16 * sizeof(float));
-    m[0] = 2 / (right - left);
-    m[5] = 2 / (top - bottom);
-    m[10] = 2 / (near - far);
-    m[15] = 1;
-    m[12] = (right + left) / (left - right);
-    m[13] = (top + bottom) / (bottom - top);
-    m[14] = (far + near) / (near - far);
+    for (size_t i = 0; i + 3 <= size && count < SEARCH_QUERY_MAX; i++)
+        out[count++] = trigram(run + i);
+    return count;
 }
 
-
-static void init_font_texture_atlas(RenderContext *rc, Font *font)
+/* Returns the index of the ']' closing the bracket expression opened at
+ * query[i], or `size` if there is none. A ']' first in the list is a
+ * member, as is one inside a [:class:], [=equivalence=] or [.collating.]
+ * element. */
+static size_t bracket_end(const char *query, size_t size, size_t i)
 {
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glGenTextures(1, &rc->texture);
-    glBindTexture(GL_TEXTURE_2D, rc->texture);
-    glTexImage2D(GL_TEXTURE_2D,
-                 0,
-                 GL_RED,
-                 font->atlas_width,
-                 font->char_height,
-                 0,
-                 GL_RED,
-                 GL_UNSIGNED_BYTE,
-                 NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    {
-        float x = 0.0f;
-        for (int i = ASCII_BEGIN; i <= ASCII_END; i++) {
-            Character *c = &font->chars[i - ASCII_BEGIN];
-            float x_offset = x;
-            c->u1 = x / (float) font->atlas_width; 
-            x += c->bitmap.width;
-            c->u2 = x / (float) font->atlas_width;
-            c->v1 = 0.0f;
-            c->v2 = (float)c->bitmap.height / (float)font->char_height;
-            glTexSubImage2D(GL_TEXTURE_2D,
-                            0,
-                            x_offset,
-                            0,
-                            c->bitmap.width,
-                            c->bitmap.height,
-                            GL_RED,
-                            GL_UNSIGNED_BYTE,
-                            c->bitmap.data
-                            );
-            free(c->bitmap.data);
-            c->bitmap.data = NULL;
-        }
-    }
-}
-
-
-static void render_init(RenderContext *rc, Font *font, int screen_width, int screen_height)
-{
-    rc->program = create_shader_program(vertex_src, fragment_src);
-    ortho(rc->projection, 0.0f, screen_width, 0.f, screen_height, -100.0f, 100.0f);
-    init_font_texture_atlas(rc, font);
-    glUseProgram(rc->program);
-    glUniformMatrix4fv(glGetUniformLocation(rc->program, "projection"), 1, GL_FALSE, rc->projection);
+    i++;
+    if (i < size && query[i] == '^')
+        i++;
+    if (i < size && query[i] == ']')
+        i++;
+    for (; i < size && query[i] != ']'; i++) {
+        if (query[i] != '[' || i + 1 >= size ||
+            (query[i + 1] != ':' && query[i + 1] != '=' && query[i + 1] != '.'))
+            continue;
+        const char delimiter = query[i + 1];
+        for (i += 2; i + 1 < size && !(query[i] == delimiter && query[i + 1] == ']'); i++)
+            ;
+        i++;
+    }
+    return i < size ? i : size;
+}
 
-    rc->vertices_size = TTY_ROWS * TTY_COLUMNS * 4 * 6 * sizeof(float);
-    rc->vertices = malloc(rc->vertices_size);
+/* Collects trigrams every match must contain. For regular expressions only
+ * literal runs outside groups and brackets count, a character followed by
+ * an optional quantifier is dropped, and any alternation disables the
+ * prefilter altogether. */
+static size_t query_trigrams(const char *query, size_t size, bool regex,
+                             uint32_t *out)
+{
+    if (!regex)
+        return push_trigrams(query, size, out, 0);
+    if (memchr(query, '|', size))
+        return 0;
 
-    glGenVertexArrays(1, &rc->vao);
-    glGenBuffers(1, &rc->vbo);
+    char run[SEARCH_QUERY_MAX];
+    size_t run_size = 0;
+    size_t count = 0;
+    int depth = 0;
+    for (size_t i = 0; i < size; i++) {
+        char c = query[i];
+        if (depth) {
+            if (c == '\\' && i + 1 < size)
+                i++;
+            else if (c == '[')
+                i = bracket_end(query, size, i);
+            else if (c == '(')
+                depth++;
+            else if (c == ')')
+                depth--;
+            continue;
+        }
+        switch (c) {
+            case '*':
+            case '?':
+            case '{':
+                if (run_size)
+                    run_size--;
+                /* fall through */
+            case '+':
+                count = push_trigrams(run, run_size, out, count);
+                run_size = 0;
+                if (c == '{') {
+                    while (i + 1 < size && query[i + 1] != '}')
+                        i++;
+                    i++;
+                }
+                break;
+            case '(':
+                depth++;
+                /* fall through */
+            case '.':
+            case '^':
+            case '$':
+                count = push_trigrams(run, run_size, out, count);
+                run_size = 0;
+                break;
+            case '[':
+                count = push_trigrams(run, run_size, out, count);
+                run_size = 0;
+                i = bracket_end(query, size, i);
+                break;
+            case '\\':
+                if (i + 1 < size && !isalnum((unsigned char) query[i + 1])) {
+                    run[run_size++] = query[++i];
+                } else {
+                    count = push_trigrams(run, run_size, out, count);
+                    run_size = 0;
+                    i++;
+                }
+                break;
+            default:
+                run[run_size++] = c;
+        }
+    }
+    return push_trigrams(run, run_size, out, count);
+}
 
-    glBindVertexArray(rc->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, rc->vbo);
-    glBufferData(GL_ARRAY_BUFFER, rc->vertices_size, NULL, GL_DYNAMIC_DRAW);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*) 0);
-    glEnableVertexAttribArray(0);
-}
-
-static void render(RenderContext *rc, Font *font, Cells *cells)
-{
-    for (size_t k = 0; k < cells->count; k++) {
-            const Cell *cell = &cells->cells[k];
-            const Character *c = &font->chars[cell->c - ASCII_BEGIN];
-            const int i = cell->x;
-            const int j = cell->y;
-            float xc = i * font->char_width + c->bearing.x;
-            float yc = j * font->char_height +
-                       font->char_height/4.0f - c->height + c->bearing.y;
-            float u1 = c->u1;
-            float u2 = c->u2;
-            float v1 = c->v1;
-            float v2 = c->v2;
-            float w = c->width;
-            float h = c->height;
-            float vertices_per_char[] = {
-                xc,     yc,   u1, v2,
-                xc+w,   yc,   u2, v2,
-                xc+w, yc+h,   u2, v1,
-
-                xc+w, yc+h,   u2, v1,
-                xc,   yc+h,   u1, v1,
-                xc,     yc,   u1, v2
-            };
-
-            memcpy(rc->vertices + k * sizeof(vertices_per_char) / sizeof(float), vertices_per_char, sizeof(vertices_per_char));
-    }
-    glBufferSubData(GL_ARRAY_BUFFER, 0, cells->count * 6 * 4 * sizeof(float), rc->vertices);
-    glBindVertexArray(rc->vao);
-    glUseProgram(rc->program);
-    glActiveTexture(GL_TEXTURE0);
-    glDrawArrays(GL_TRIANGLES, 0, 6 * cells->count);
+static void search_job_free(SearchJob *job)
+{
+    for (int i = 0; i < job->workers; i++)
+        if (job->compiled[i])
+            regfree(&job->regexes[i]);
+    free(job->regexes);
+    free(job->compiled);
+    free(job->blocks);
+    free(job);
 }
 
-static void init_cells(Cells *cells)
+static void init_search(Search *s, ThreadPool *pool, size_t cells)
 {
-    memset(cells, 0, sizeof(Cells));
-    cells->capacity = TTY_COUNT;
-    cells->cells = malloc(sizeof(Cell) * cells->capacity);
-    if (cells->cells == NULL)
+    memset(s, 0, sizeof(Search));
+    s->pool = pool;
+    s->at_line = SIZE_MAX;
+    pthread_mutex_init(&s->lock, NULL);
+    s->highlight_size = cells;
+    s->highlight = calloc(s->highlight_size, 1);
+    if (s->highlight == NULL)
         fatal("Malloc failed.");
 }
 
-static void push_cell(Cells *cells, char c, int x, int y)
+/* Frees retired jobs whose remaining (cancelled) tasks have drained. */
+static void search_reap(Search *s)
 {
-    if (cells->count >= cells->capacity)
-        fatal("Cells capacity overflow");
-    Cell *cell = &cells->cells[cells->count];
-    cell->c = c;
-    cell->x = x;
-    cell->y = TTY_ROWS - 1 - y;
-    cells->count++;
+    SearchJob **link = &s->retired;
+    while (*link) {
+        SearchJob *job = *link;
+        if (pool_done(s->pool, &job->batch)) {
+            *link = job->next;
+            search_job_free(job);
+        } else {
+            link = &job->next;
+        }
+    }
 }
 
-static void init_terminal(Terminal *t)
+static void search_cancel(Search *s)
 {
-    memset(t, 0, sizeof(Terminal));
-    t->columns = TTY_COLUMNS;
-    t->rows = TTY_ROWS;
+    pthread_mutex_lock(&s->lock);
+    if (s->job) {
+        s->job->cancelled = true;
+        s->job->next = s->retired;
+        s->retired = s->job;
+        s->job = NULL;
+    }
+    s->matches.count = 0;
+    pthread_mutex_unlock(&s->lock);
+    if (s->compiled_valid) {
+        regfree(&s->compiled);
+        s->compiled_valid = false;
+    }
+    s->invalid = false;
+    s->screen_matches = 0;
+    s->at_line = SIZE_MAX;
+    s->at_column = 0;
+    s->title_stale = true;
+    memset(s->highlight, 0, s->highlight_size);
+    s->highlight_version++;
 }
 
-static inline bool is_printable_ascii(char c)
+static void search_screen(Search *s, const Terminal *t, Cells *cells)
 {
-    return (c >= ASCII_BEGIN) && (c <= ASCII_END);
+    memset(s->highlight, 0, s->highlight_size);
+    s->highlight_version++;
+    s->screen_matches = 0;
+    if (!s->active || s->invalid || s->query_size == 0)
+        return;
+
+    /* Rows are searched as UTF-8, with the column of every byte kept to
+     * map matches back to cells. */
+    const size_t capacity = (size_t) t->rows * (t->columns * CELL_UTF8_MAX + 1) + 1;
+    char *text = malloc(capacity);
+    uint16_t *where = malloc(sizeof(uint16_t) * capacity);
+    size_t *starts = malloc(sizeof(size_t) * (t->rows + 1));
+    if (text == NULL || where == NULL || starts == NULL)
+        fatal("Malloc failed.");
+    size_t size = 0;
+    for (int y = 0; y < t->rows; y++) {
+        starts[y] = size;
+        size += row_text(cells, &t->clusters, t->columns, y, text + size, where + size);
+        text[size++] = '\n';
+    }
+    starts[t->rows] = size;
+    text[size] = '\0';
+
+    SearchMatches found = {0};
+    search_text(text, size, 0, s->query, s->query_size,
+                s->regex ? &s->compiled : NULL, &found);
+    for (size_t i = 0; i < found.count; i++) {
+        const SearchMatch *m = &found.items[i];
+        /* Matches are cut at the end of their row, the '\n'. */
+        const size_t first = starts[m->line] + m->column;
+        const size_t newline = starts[m->line + 1] - 1;
+        if (m->length == 0 || first >= newline)
+            continue;
+        const size_t last = (first + m->length < newline ? first + m->length
+                                                         : newline) - 1;
+        const Cell *row = cells_row(cells, m->line);
+        size_t end = where[last] + 1;
+        if (end < (size_t) t->columns && (cell_flags(row[end]) & CELL_SPACER))
+            end++;
+        memset(s->highlight + m->line * t->columns + where[first], 1,
+               end - where[first]);
+    }
+    s->screen_matches = found.count;
+    free(found.items);
+    free(text);
+    free(where);
+    free(starts);
 }
-static void recalculate_cursor(Terminal *t)
+
+/* Follows a resize of the screen: highlights are indexed by cell. */
+static void search_resize(Search *s, const Terminal *t, Cells *cells)
 {
-    t->cursor_y += t->cursor_x / t->columns;
-    t->cursor_x = t->cursor_x % t->columns;
+    s->highlight_size = cells->count;
+    s->highlight = realloc(s->highlight, s->highlight_size);
+    if (s->highlight == NULL)
+        fatal("Realloc failed.");
+    search_screen(s, t, cells);
 }
-static void write_to_terminal(Terminal *t, Cells *c, void *buf, size_t size)
+
+/* Restarts the search for the current query. Only the visible screen and the
+ * open scrollback block are scanned here; sealed blocks go to the pool. */
+static void search_start(Search *s, const Terminal *t, Cells *cells,
+                         const Scrollback *sb)
 {
-    char *b = buf;
-    for(size_t i = 0; i < size; i++) {
-        log_info("write: %c", b[i]);
-        if (is_printable_ascii(b[i])) {
-            recalculate_cursor(t);
-            push_cell(c, b[i], t->cursor_x, t->cursor_y);
-            t->cursor_x++;
-        } else if (b[i] == '\n') {
-            t->cursor_x = 0;
-            t->cursor_y++;
+    search_cancel(s);
+    if (s->query_size == 0)
+        return;
+    if (s->regex) {
+        if (regcomp(&s->compiled, s->query, REG_EXTENDED | REG_NEWLINE) != 0) {
+            s->invalid = true;
+            return;
         }
+        s->compiled_valid = true;
+    }
+    search_screen(s, t, cells);
+
+    const size_t sealed = sb->count ? sb->count - 1 : 0;
+    if (sb->count) {
+        const ScrollbackBlock *open = sb->blocks[sb->count - 1];
+        SearchMatches found = {0};
+        search_text(open->data, open->size, open->first_line,
+                    s->query, s->query_size,
+                    s->regex ? &s->compiled : NULL, &found);
+        pthread_mutex_lock(&s->lock);
+        for (size_t i = 0; i < found.count; i++)
+            matches_push(&s->matches, found.items[i].line,
+                         found.items[i].column, found.items[i].length);
+        pthread_mutex_unlock(&s->lock);
+        free(found.items);
     }
+    if (sealed == 0)
+        return;
+
+    SearchJob *job = calloc(1, sizeof(SearchJob));
+    if (job == NULL)
+        fatal("Malloc failed.");
+    job->search = s;
+    memcpy(job->query, s->query, s->query_size + 1);
+    job->query_size = s->query_size;
+    job->regex = s->regex;
+    job->trigram_count = query_trigrams(job->query, job->query_size,
+                                        job->regex, job->trigrams);
+    job->workers = s->pool->count + 1;
+    job->regexes = malloc(sizeof(regex_t) * job->workers);
+    job->compiled = calloc(job->workers, sizeof(bool));
+    job->blocks = malloc(sizeof(ScrollbackBlock *) * sealed);
+    if (job->regexes == NULL || job->compiled == NULL || job->blocks == NULL)
+        fatal("Malloc failed.");
+    /* Newest history first, that is what the user most likely looks for. */
+    for (size_t i = 0; i < sealed; i++)
+        job->blocks[i] = sb->blocks[sealed - 1 - i];
+    s->job = job;
+    pool_submit(s->pool, &job->batch, search_block_task, job, sealed);
+}
+
+/* Returns whether the number of matches changed. */
+static bool search_update_title(Search *s, GLFWwindow *window)
+{
+    pthread_mutex_lock(&s->lock);
+    const size_t matches = s->matches.count + s->screen_matches;
+    pthread_mutex_unlock(&s->lock);
+    const bool done = s->job == NULL || pool_done(s->pool, &s->job->batch);
+    const bool changed = matches != s->reported_matches;
+    if (!changed && done == s->reported_done && !s->title_stale)
+        return false;
+    s->reported_matches = matches;
+    s->reported_done = done;
+    s->title_stale = false;
+
+    char title[SEARCH_QUERY_MAX + 64];
+    if (!s->active)
+        snprintf(title, sizeof(title), "gltty");
+    else if (s->invalid)
+        snprintf(title, sizeof(title), "gltty - %s: %s (invalid)",
+                 s->regex ? "regex" : "search", s->query);
+    else
+        snprintf(title, sizeof(title), "gltty - %s: %s (%zu matches%s)",
+                 s->regex ? "regex" : "search", s->query, matches,
+                 done ? "" : ", searching");
+    glfwSetWindowTitle(window, title);
+    return changed;
 }
 
 static void setup_tty(int *master)
@@ -450,11 +4834,561 @@ static void setup_tty(int *master)
     }
 }
 
+/* Called with app->lock held. */
+static void app_changed(App *app)
+{
+    app->generation++;
+    pthread_cond_signal(&app->changed);
+}
+
+/* Drains whatever the child has written without blocking the frame. Returns
+ * -1 once the child side of the PTY is gone. */
+static int read_tty(App *app)
+{
+    char input[4096];
+    int reads = 0;
+    while (reads < TTY_READS_PER_FRAME) {
+        fd_set fd_in;
+        struct timeval timeout = {0, 0};
+        FD_ZERO(&fd_in);
+        FD_SET(app->master, &fd_in);
+        int rc = select(app->master + 1, &fd_in, NULL, NULL, &timeout);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            fatal("select() error: %s", strerror(errno));
+        }
+        if (rc == 0 || !FD_ISSET(app->master, &fd_in))
+            break;
+        ssize_t size = read(app->master, input, sizeof(input));
+        if (size <= 0) {
+            if (size < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* Locked per chunk so the render thread can snapshot in between. */
+        pthread_mutex_lock(&app->lock);
+        write_to_terminal(app->terminal, &app->cells, app->scrollback,
+                          input, size);
+        if (app->input_time && app->echo_time == 0) {
+            app->echo_time = app->input_time;
+            app->input_time = 0;
+        }
+        app_changed(app);
+        pthread_mutex_unlock(&app->lock);
+        reads++;
+    }
+    return reads;
+}
+
+static void write_tty(App *app, const char *data, size_t size)
+{
+    pthread_mutex_lock(&app->lock);
+    if (app->input_time == 0)
+        app->input_time = glfwGetTime();
+    /* Typing returns to the live screen. */
+    if (app->view) {
+        app->view = 0;
+        app_changed(app);
+    }
+    pthread_mutex_unlock(&app->lock);
+    while (size) {
+        ssize_t written = write(app->master, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            log_info("write() error: %s", strerror(errno));
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+/* Tells the child the current grid size, which also raises SIGWINCH. */
+static void send_winsize(App *app)
+{
+    pthread_mutex_lock(&app->lock);
+    const struct winsize ws = {
+        .ws_row = app->terminal->rows,
+        .ws_col = app->terminal->columns,
+        .ws_xpixel = app->terminal->columns * app->cell_width,
+        .ws_ypixel = app->terminal->rows * app->cell_height,
+    };
+    pthread_mutex_unlock(&app->lock);
+    if (ioctl(app->master, TIOCSWINSZ, &ws) == -1)
+        log_info("ioctl(TIOCSWINSZ) error: %s", strerror(errno));
+}
+
+/* Moves the view to the scrollback match before (older) or after the one
+ * moved to last, or back to the live screen past the newest. */
+static void search_step(App *app, bool older)
+{
+    Search *s = app->search;
+    const SearchMatch *best = NULL;
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; i < s->matches.count; i++) {
+        const SearchMatch *m = &s->matches.items[i];
+        const bool before = m->line < s->at_line ||
+                            (m->line == s->at_line && m->column < s->at_column);
+        const bool after = m->line > s->at_line ||
+                           (m->line == s->at_line && m->column > s->at_column);
+        if (older ? !before : !after)
+            continue;
+        if (best == NULL ||
+            (older ? m->line > best->line || (m->line == best->line && m->column > best->column)
+                   : m->line < best->line || (m->line == best->line && m->column < best->column)))
+            best = m;
+    }
+    if (best) {
+        s->at_line = best->line;
+        s->at_column = best->column;
+        app->view = scrollback_line_distance(app->scrollback, best->line, best->column);
+    } else if (!older) {
+        s->at_line = SIZE_MAX;
+        s->at_column = 0;
+        app->view = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void search_key(App *app, int key)
+{
+    Search *s = app->search;
+    switch (key) {
+        case GLFW_KEY_UP:
+        case GLFW_KEY_DOWN:
+            if (!app->terminal->alternate)
+                search_step(app, key == GLFW_KEY_UP);
+            return;
+        case GLFW_KEY_ESCAPE:
+            s->prompt = false;
+            s->active = false;
+            search_cancel(s);
+            return;
+        case GLFW_KEY_ENTER:
+            s->prompt = false;
+            return;
+        case GLFW_KEY_TAB:
+            s->regex = !s->regex;
+            break;
+        case GLFW_KEY_BACKSPACE:
+            if (s->query_size == 0)
+                return;
+            s->query[--s->query_size] = '\0';
+            break;
+        default:
+            return;
+    }
+    search_start(s, app->terminal, app->cells, app->scrollback);
+}
+
+static void key_callback(GLFWwindow *window, int key, int scancode, int action,
+                         int mods)
+{
+    (void) scancode;
+    App *app = glfwGetWindowUserPointer(window);
+    if (action == GLFW_RELEASE)
+        return;
+
+    if (key == GLFW_KEY_F && mods == (GLFW_MOD_CONTROL | GLFW_MOD_SHIFT)) {
+        Search *s = app->search;
+        pthread_mutex_lock(&app->lock);
+        s->prompt = true;
+        s->active = true;
+        search_start(s, app->terminal, app->cells, app->scrollback);
+        app_changed(app);
+        pthread_mutex_unlock(&app->lock);
+        return;
+    }
+    if (app->search->prompt) {
+        pthread_mutex_lock(&app->lock);
+        search_key(app, key);
+        app_changed(app);
+        pthread_mutex_unlock(&app->lock);
+        return;
+    }
+    if (mods == GLFW_MOD_SHIFT &&
+        (key == GLFW_KEY_PAGE_UP || key == GLFW_KEY_PAGE_DOWN)) {
+        pthread_mutex_lock(&app->lock);
+        const size_t page = app->terminal->rows;
+        if (key == GLFW_KEY_PAGE_UP)
+            app->view = scrollback_depth(app->scrollback, app->view + page);
+        else
+            app->view = app->view > page ? app->view - page : 0;
+        app_changed(app);
+        pthread_mutex_unlock(&app->lock);
+        return;
+    }
+
+    const char *seq = NULL;
+    switch (key) {
+        case GLFW_KEY_ENTER: seq = "\r"; break;
+        case GLFW_KEY_BACKSPACE: seq = "\x7f"; break;
+        case GLFW_KEY_TAB: seq = "\t"; break;
+        case GLFW_KEY_ESCAPE: seq = "\x1b"; break;
+        case GLFW_KEY_UP: seq = "\x1b[A"; break;
+        case GLFW_KEY_DOWN: seq = "\x1b[B"; break;
+        case GLFW_KEY_RIGHT: seq = "\x1b[C"; break;
+        case GLFW_KEY_LEFT: seq = "\x1b[D"; break;
+    }
+    if (seq) {
+        write_tty(app, seq, strlen(seq));
+    } else if ((mods & GLFW_MOD_CONTROL) && key >= GLFW_KEY_A && key <= GLFW_KEY_Z) {
+        char c = key - GLFW_KEY_A + 1;
+        write_tty(app, &c, 1);
+    }
+}
+
+static void char_callback(GLFWwindow *window, unsigned int codepoint)
+{
+    App *app = glfwGetWindowUserPointer(window);
+    Search *s = app->search;
+    if (s->prompt) {
+        if (codepoint > 0x7f || s->query_size == SEARCH_QUERY_MAX)
+            return;
+        pthread_mutex_lock(&app->lock);
+        s->query[s->query_size++] = codepoint;
+        s->query[s->query_size] = '\0';
+        search_start(s, app->terminal, app->cells, app->scrollback);
+        app_changed(app);
+        pthread_mutex_unlock(&app->lock);
+        return;
+    }
+
+    char utf8[4];
+    const size_t size = utf8_encode(codepoint, utf8);
+    write_tty(app, utf8, size);
+}
+
+static void iconify_callback(GLFWwindow *window, int iconified)
+{
+    App *app = glfwGetWindowUserPointer(window);
+    pthread_mutex_lock(&app->lock);
+    app->iconified = iconified;
+    app_changed(app);
+    pthread_mutex_unlock(&app->lock);
+}
+
+static void focus_callback(GLFWwindow *window, int focused)
+{
+    App *app = glfwGetWindowUserPointer(window);
+    pthread_mutex_lock(&app->lock);
+    app->focused = focused;
+    app_changed(app);
+    pthread_mutex_unlock(&app->lock);
+}
+
+/* The grid is reflowed right away so the next frame has the new size, but
+ * the child only hears of it once the size settles, in the main loop:
+ * every TIOCSWINSZ makes shells and editors redraw their whole screen. */
+static void framebuffer_size_callback(GLFWwindow *window, int width, int height)
+{
+    App *app = glfwGetWindowUserPointer(window);
+    if (width <= 0 || height <= 0)
+        return;
+    int columns = width / app->cell_width;
+    int rows = height / app->cell_height;
+    if (columns < 1)
+        columns = 1;
+    if (rows < 1)
+        rows = 1;
+    pthread_mutex_lock(&app->lock);
+    app->width = width;
+    app->height = height;
+    Terminal *t = app->terminal;
+    if (columns != t->columns || rows != t->rows) {
+        resize_terminal(t, app->cells, app->scrollback, columns, rows);
+        search_resize(app->search, t, app->cells);
+        app->resize_time = glfwGetTime();
+    }
+    app_changed(app);
+    pthread_mutex_unlock(&app->lock);
+}
+
+/* Sleeps in select() without the lock, then parses everything readable,
+ * so parsing never waits on a buffer swap. */
+static void *tty_thread(void *arg)
+{
+    App *app = arg;
+    for (;;) {
+        fd_set fd_in;
+        FD_ZERO(&fd_in);
+        FD_SET(app->master, &fd_in);
+        if (select(app->master + 1, &fd_in, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            fatal("select() error: %s", strerror(errno));
+        }
+        const int reads = read_tty(app);
+        pthread_mutex_lock(&app->lock);
+        if (reads < 0)
+            app->quit = true;
+        else if (reads > 0 && app->search->active)
+            search_screen(app->search, app->terminal, app->cells);
+        app_changed(app);
+        const bool wake = reads < 0 || app->search->active;
+        pthread_mutex_unlock(&app->lock);
+        /* The main thread owns the window title and closing the window. */
+        if (wake)
+            glfwPostEmptyEvent();
+        if (reads < 0)
+            return NULL;
+    }
+}
+
+/* The grid size is taken from the first snapshot. */
+static void init_snapshot(Snapshot *s)
+{
+    memset(s, 0, sizeof(Snapshot));
+    s->terminal.styles.version = ~0u;
+    s->highlight_version = ~0u;
+}
+
+/* Called with app->lock held. Copies the spans damaged since the last
+ * snapshot and moves their damage over, plus styles and highlights when
+ * their versions changed, so the lock is held for a few row copies and
+ * never while building or submitting a frame. */
+static void snapshot_take(Snapshot *s, App *app)
+{
+    Cells *cells = app->cells;
+    if (s->cells.columns != cells->columns || s->cells.rows != cells->rows) {
+        /* A resize damages every row of the source, so all of it is
+         * copied below. */
+        cells_resize_storage(&s->cells, cells->columns, cells->rows);
+        s->terminal.columns = cells->columns;
+        s->terminal.rows = cells->rows;
+        s->highlight = realloc(s->highlight, cells->count);
+        if (s->highlight == NULL)
+            fatal("Realloc failed.");
+        s->highlight_version = ~0u;
+    }
+    /* History rows shift under the view with every scroll, so a scrolled
+     * back view is composed whole: history above, the top of the screen
+     * below. Leaving it, or switching screens, copies the whole screen.
+     * The alternate screen has no history to view. Rows left stale by a
+     * clear are copied as blanks without being filled in. */
+    const size_t view = app->terminal->alternate ? 0 :
+                        scrollback_depth(app->scrollback, app->view);
+    app->view = view;
+    const bool whole = view || s->view || s->source != cells || cells->damage_all;
+    s->source = cells;
+    cells->damage_all = false;
+    for (int y = 0; y < cells->rows; y++) {
+        Damage d = take_damage(cells, y);
+        if (whole) {
+            d.begin = 0;
+            d.end = cells->columns;
+        }
+        if (view || d.begin >= d.end)
+            continue;
+        const size_t offset = (size_t) y * cells->columns + d.begin;
+        if (row_stale(cells, y))
+            fill_cells(s->cells.cells + offset, cells->blank, d.end - d.begin);
+        else
+            memcpy(s->cells.cells + offset, cells->cells + offset,
+                   sizeof(Cell) * (d.end - d.begin));
+        damage_cells(&s->cells, y, d.begin, d.end);
+    }
+    s->cells.top = cells->top;
+    s->view = view;
+    if (view) {
+        const int history = view < (size_t) cells->rows ? (int) view : cells->rows;
+        scrollback_rows(app->scrollback, view, history, s->cells.cells);
+        for (int y = history; y < cells->rows; y++)
+            memcpy(s->cells.cells + (size_t) y * cells->columns,
+                   cells_row(cells, y - view), sizeof(Cell) * cells->columns);
+        s->cells.top = 0;
+        for (int y = 0; y < cells->rows; y++)
+            damage_cells(&s->cells, y, 0, cells->columns);
+    }
+
+    const Terminal *t = app->terminal;
+    s->terminal.reverse = t->reverse;
+    StyleTable *styles = &s->terminal.styles;
+    if (styles->version != t->styles.version) {
+        if (styles->capacity != t->styles.capacity) {
+            styles->capacity = t->styles.capacity;
+            styles->styles = realloc(styles->styles, sizeof(Style) * styles->capacity);
+            if (styles->styles == NULL)
+                fatal("Realloc failed.");
+        }
+        memcpy(styles->styles, t->styles.styles, sizeof(Style) * styles->capacity);
+        styles->version = t->styles.version;
+    }
+
+    /* A scrolled back view takes the scrollback matches in its history
+     * rows and the screen's below them. It is redrawn whole every frame
+     * anyway, and the live highlights are copied back on leaving it. */
+    Search *search = app->search;
+    s->highlighted = search->active;
+    if (view && search->active) {
+        const int history = view < (size_t) cells->rows ? (int) view : cells->rows;
+        pthread_mutex_lock(&search->lock);
+        scrollback_highlight(app->scrollback, view, history, &search->matches,
+                             s->highlight);
+        pthread_mutex_unlock(&search->lock);
+        memcpy(s->highlight + (size_t) history * cells->columns, search->highlight,
+               (size_t) (cells->rows - history) * cells->columns);
+        s->highlight_version = ~0u;
+    } else if (s->highlight_version != search->highlight_version) {
+        memcpy(s->highlight, search->highlight, cells->count);
+        s->highlight_version = search->highlight_version;
+    }
+
+    if (app->echo_time && s->input_time == 0)
+        s->input_time = app->echo_time;
+    app->echo_time = 0;
+    s->width = app->width;
+    s->height = app->height;
+}
+
+static void sleep_until(double deadline)
+{
+    const double delay = deadline - glfwGetTime();
+    if (delay <= 0)
+        return;
+    struct timespec ts = {
+        .tv_sec = (time_t) delay,
+        .tv_nsec = (long) ((delay - (time_t) delay) * 1e9),
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+typedef struct {
+    double sum;
+    double max;
+    unsigned count;
+} LatencyStats;
+
+/* Input to present latency: from writing input to the pty to the return
+ * of the swap showing the first output that followed it. */
+static void latency_record(LatencyStats *stats, PresentMode present,
+                           double latency)
+{
+    static const char *names[] = {"vsync", "immediate", "latency"};
+    stats->sum += latency;
+    if (latency > stats->max)
+        stats->max = latency;
+    if (++stats->count < LATENCY_REPORT_FRAMES)
+        return;
+    log_info("Input to present (%s): avg %.2f ms, max %.2f ms over %u frames",
+             names[present], stats->sum / stats->count * 1000.0,
+             stats->max * 1000.0, stats->count);
+    memset(stats, 0, sizeof(LatencyStats));
+}
+
+/* Renders a frame whenever the generation moved, from a snapshot taken
+ * under the lock, then swaps: a swap blocked on vsync holds up neither
+ * parsing nor input. */
+static void *render_thread(void *arg)
+{
+    RenderThread *r = arg;
+    App *app = r->app;
+    glfwMakeContextCurrent(r->window);
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+        fatal("Failed to load GLAD.");
+
+    RenderContext rc = {0};
+    render_init(&rc, r->font, r->mode, r->pool);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glfwSwapInterval(r->present == PRESENT_IMMEDIATE ? 0 : 1);
+
+    Snapshot snapshot;
+    init_snapshot(&snapshot);
+    LatencyStats stats = {0};
+    /* Return time of the last swap, taken as a vblank, and the decaying
+     * peak of snapshot to GPU completion. */
+    double vblank = 0;
+    double cost = 0;
+    unsigned rendered = app->generation - 1;
+    for (;;) {
+        pthread_mutex_lock(&app->lock);
+        while (!app->quit && (app->generation == rendered || app->iconified))
+            pthread_cond_wait(&app->changed, &app->lock);
+        if (app->quit) {
+            pthread_mutex_unlock(&app->lock);
+            break;
+        }
+
+        /* Late latching: sample the grid as late as the next vblank allows.
+         * After a long idle the vblank phase is unknown; the swap of this
+         * frame establishes it again. */
+        if (r->present == PRESENT_LATENCY && glfwGetTime() - vblank < 1.0) {
+            pthread_mutex_unlock(&app->lock);
+            const double now = glfwGetTime();
+            double next = vblank + r->refresh_period;
+            while (next - cost - PRESENT_MARGIN < now)
+                next += r->refresh_period;
+            sleep_until(next - cost - PRESENT_MARGIN);
+            pthread_mutex_lock(&app->lock);
+        }
+        const double start = glfwGetTime();
+        const bool focused = app->focused;
+        rendered = app->generation;
+        snapshot_take(&snapshot, app);
+        pthread_mutex_unlock(&app->lock);
+
+        if (rc.width != snapshot.width || rc.height != snapshot.height ||
+            rc.columns != snapshot.cells.columns || rc.rows != snapshot.cells.rows)
+            render_resize(&rc, snapshot.width, snapshot.height,
+                          snapshot.cells.columns, snapshot.cells.rows);
+        const float clear = snapshot.terminal.reverse ? 1.0f : 0.0f;
+        glClearColor(clear, clear, clear, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        render(&rc, &snapshot.terminal, &snapshot.cells,
+               snapshot.highlighted ? snapshot.highlight : NULL,
+               snapshot.highlight_version);
+        if (r->present == PRESENT_LATENCY) {
+            GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                    1000000000) == GL_TIMEOUT_EXPIRED)
+                ;
+            glDeleteSync(fence);
+            /* A frame costing more than half a period is an outlier, a
+             * shader compile or a large redraw, not worth latching for. */
+            double sample = glfwGetTime() - start;
+            if (sample > r->refresh_period / 2)
+                sample = r->refresh_period / 2;
+            cost = sample > cost ? sample : cost * 0.9 + sample * 0.1;
+        }
+        glfwSwapBuffers(r->window);
+        if (r->present == PRESENT_LATENCY) {
+            /* Blocks until the flip so the return time tracks the vblank.
+             * Returns are jittered by wakeup latency, so each one only
+             * nudges the phase predicted from the previous vblank. */
+            glFinish();
+            const double now = glfwGetTime();
+            const double periods = (now - vblank) / r->refresh_period;
+            if (now - vblank < 1.0) {
+                const double predicted = vblank + (long) (periods + 0.5) * r->refresh_period;
+                vblank = predicted + (now - predicted) * 0.1;
+            } else {
+                vblank = now;
+            }
+        } else {
+            vblank = glfwGetTime();
+        }
+
+        if (snapshot.input_time) {
+            latency_record(&stats, r->present, vblank - snapshot.input_time);
+            snapshot.input_time = 0;
+        }
+        /* Output arriving meanwhile is folded into the next snapshot. */
+        if (!focused)
+            sleep_until(start + UNFOCUSED_FRAME_INTERVAL);
+    }
+    return NULL;
+}
+
 int main(void)
 {
     int master;
     setup_tty(&master);
-    const char *font_path = "/usr/share/fonts/TTF/JetBrainsMono-Regular.ttf";
+    const char *font_name = "JetBrains Mono,monospace";
     const int font_size = 16;
     
     if (glfwInit() != GLFW_TRUE)
@@ -463,11 +5397,11 @@ int main(void)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
 
     Font font = {0};
-    font_init(&font, font_path, font_size);
+    font_init(&font, font_name, font_size);
 
     const int screen_width = font.char_width * TTY_COLUMNS;
     const int screen_height  = font.char_height * TTY_ROWS;
@@ -475,52 +5409,120 @@ int main(void)
     GLFWwindow *window = glfwCreateWindow(screen_width, screen_height, "gltty", NULL, NULL);
     if (!window)
         fatal("Failed to create GLFW window.");
-    glfwMakeContextCurrent(window);
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
-        fatal("Failed to load GLAD.");
+    /* The framebuffer can be larger than the window on high DPI screens. */
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    const int columns = width / font.char_width > 0 ? width / font.char_width : 1;
+    const int rows = height / font.char_height > 0 ? height / font.char_height : 1;
 
-    RenderContext rc = {0};
-    render_init(&rc, &font, screen_width, screen_height);
+    /* GLTTY_RENDERER=grid selects the GPU resident grid renderer and
+     * GLTTY_RENDERER=retained the damage tracking framebuffer. */
+    const char *renderer = getenv("GLTTY_RENDERER");
+    RenderMode mode = RENDER_INSTANCED;
+    if (renderer && strcmp(renderer, "grid") == 0)
+        mode = RENDER_GRID;
+    else if (renderer && strcmp(renderer, "retained") == 0)
+        mode = RENDER_RETAINED;
+    ThreadPool pool;
+    pool_init(&pool);
 
     Cells cells = {0};
-    init_cells(&cells);
+    init_cells(&cells, columns, rows);
 
     char *buf = malloc(1024);
     strcpy(buf, vertex_src);
 
     Terminal terminal;
-    init_terminal(&terminal);
-    char input[1024];
-    {
-        int rc;
-        fd_set fd_in;
-        FD_ZERO(&fd_in);
-        FD_SET(master, &fd_in);
-        rc = select(master + 1, &fd_in, NULL, NULL, NULL);
-        switch (rc) {
-            case -1: 
-                fatal("select() error: %s", strerror(errno));
-                break;
-            default:
-                {
-                    if (FD_ISSET(master, &fd_in)) {
-                        rc = read(master, input, sizeof(input));
-                        write_to_terminal(&terminal,  &cells, input, rc);
-                    }
-                }
-        }
-    }
+    init_terminal(&terminal, columns, rows);
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    while (!glfwWindowShouldClose(window)) {
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-        render(&rc, &font, &cells);
+    Scrollback scrollback;
+    init_scrollback(&scrollback, &pool, columns);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    Search search;
+    init_search(&search, &pool, cells.count);
+
+    App app = {
+        .master = master,
+        .terminal = &terminal,
+        .cells = &cells,
+        .scrollback = &scrollback,
+        .search = &search,
+        .focused = glfwGetWindowAttrib(window, GLFW_FOCUSED),
+        .width = width,
+        .height = height,
+        .cell_width = font.char_width,
+        .cell_height = font.char_height,
+    };
+    pthread_mutex_init(&app.lock, NULL);
+    pthread_cond_init(&app.changed, NULL);
+    glfwSetWindowUserPointer(window, &app);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetCharCallback(window, char_callback);
+    glfwSetWindowIconifyCallback(window, iconify_callback);
+    glfwSetWindowFocusCallback(window, focus_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    send_winsize(&app);
+
+    /* GLTTY_PRESENT=immediate disables vsync and GLTTY_PRESENT=latency
+     * renders each frame just before the vblank. */
+    const char *present = getenv("GLTTY_PRESENT");
+    PresentMode present_mode = PRESENT_VSYNC;
+    if (present && strcmp(present, "immediate") == 0)
+        present_mode = PRESENT_IMMEDIATE;
+    else if (present && strcmp(present, "latency") == 0)
+        present_mode = PRESENT_LATENCY;
+    const GLFWvidmode *video = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    const int refresh = video && video->refreshRate > 0 ? video->refreshRate : 60;
+
+    RenderThread render = {
+        .app = &app,
+        .window = window,
+        .font = &font,
+        .mode = mode,
+        .present = present_mode,
+        .refresh_period = 1.0 / refresh,
+        .pool = &pool,
+    };
+    pthread_t render_id, tty_id;
+    if (pthread_create(&render_id, NULL, render_thread, &render) != 0 ||
+        pthread_create(&tty_id, NULL, tty_thread, &app) != 0)
+        fatal("pthread_create() failed.");
+
+    while (!glfwWindowShouldClose(window)) {
+        /* Running searches report progress in the title; a new grid size
+         * goes to the child once it held for RESIZE_DEBOUNCE. */
+        double timeout = search.active ? 0.1 : 0;
+        if (app.resize_time) {
+            const double settle = app.resize_time + RESIZE_DEBOUNCE - glfwGetTime();
+            if (settle <= 0) {
+                pthread_mutex_lock(&app.lock);
+                scrollback_reflow(&scrollback);
+                pthread_mutex_unlock(&app.lock);
+                send_winsize(&app);
+                app.resize_time = 0;
+            } else if (timeout == 0 || settle < timeout) {
+                timeout = settle;
+            }
+        }
+        if (timeout > 0)
+            glfwWaitEventsTimeout(timeout);
+        else
+            glfwWaitEvents();
+        pthread_mutex_lock(&app.lock);
+        if (app.quit)
+            glfwSetWindowShouldClose(window, GLFW_TRUE);
+        search_reap(&search);
+        scrollback_reap(&scrollback);
+        /* Scrollback matches that streamed in show in a scrolled back view. */
+        if (search_update_title(&search, window) && app.view)
+            app_changed(&app);
+        pthread_mutex_unlock(&app.lock);
     }
+
+    pthread_mutex_lock(&app.lock);
+    app.quit = true;
+    pthread_cond_signal(&app.changed);
+    pthread_mutex_unlock(&app.lock);
+    pthread_join(render_id, NULL);
     return 0;
 }
-